@@ -9,6 +9,7 @@
 #include <new>
 #include <cassert>
 #include "resource.h"
+#include "../furigana_gdi/furigana_trace.h"
 
 // FIXME: 醜いコード
 #undef min
@@ -17,6 +18,11 @@
 #define min std::min
 #define max std::max
 
+// 古いSDKにはない
+#ifndef WM_DPICHANGED_AFTERPARENT
+    #define WM_DPICHANGED_AFTERPARENT 0x02E3
+#endif
+
 // デバッグ出力
 static inline void DPRINTF(LPCWSTR fmt, ...) {
 #ifndef NDEBUG
@@ -58,7 +64,9 @@ void FuriganaCtl_impl::reset_colors() {
 }
 
 void FuriganaCtl_impl::update_scroll_info() {
+    FURIGANA_TRACE_SCOPE("FuriganaCtl_impl::update_scroll_info");
     DWORD style = m_self->get_style();
+    INT old_scroll_x = m_scroll_x, old_scroll_y = m_scroll_y;
 
     if (style & FCS_NOSCROLL) {
         style &= ~(WS_HSCROLL | WS_VSCROLL);
@@ -109,19 +117,119 @@ void FuriganaCtl_impl::update_scroll_info() {
         m_scroll_y = 0;
     }
 
-    m_doc.set_dirty();
-    BaseTextBox_impl::invalidate();
+    // 範囲が変わっただけなら表示は変わらない。スクロール位置が変わったときだけ内容をずらす。
+    scroll_client(old_scroll_x, old_scroll_y);
+}
+
+// スクロール位置が変わった後に、描画済みの内容をずらして新しく見える部分だけを無効にする。
+// レイアウトは変わらないので、描画では見えるようになった帯の部分だけを描けばよい。
+void FuriganaCtl_impl::scroll_client(INT old_scroll_x, INT old_scroll_y) {
+    INT dx = old_scroll_x - m_scroll_x, dy = old_scroll_y - m_scroll_y;
+    if (!dx && !dy)
+        return;
+
+    RECT rcClient;
+    ::GetClientRect(m_hwnd, &rcClient);
+    if (abs(dx) >= rcClient.right - rcClient.left || abs(dy) >= rcClient.bottom - rcClient.top) {
+        // 前の内容が残らない
+        BaseTextBox_impl::invalidate();
+        return;
+    }
+
+    // まだ描かれていない部分も内容と一緒にずらす
+    HRGN hrgnUpdate = ::CreateRectRgn(0, 0, 0, 0);
+    if (!hrgnUpdate) {
+        BaseTextBox_impl::invalidate();
+        return;
+    }
+    INT region = ::GetUpdateRgn(m_hwnd, hrgnUpdate, FALSE);
+
+    ::ScrollWindowEx(m_hwnd, dx, dy, NULL, NULL, NULL, NULL, SW_INVALIDATE);
+
+    if (region != NULLREGION && region != ERROR) {
+        ::OffsetRgn(hrgnUpdate, dx, dy);
+        ::InvalidateRgn(m_hwnd, hrgnUpdate, FALSE);
+    }
+    ::DeleteObject(hrgnUpdate);
 }
 
 // 無効にして再描画
 void FuriganaCtl_impl::invalidate() {
     if (m_doc.m_text != m_text) {
-        m_doc.clear();
+        // 変わった段落だけを解析し直す
         m_doc.set_text(m_text, get_draw_flags());
         DPRINTF(L"[invalidate] parts count: %d\n", (INT)m_doc.m_parts.size());
     }
 
-    update_scroll_info();
+    request_scroll_info();
+}
+
+// スクロール情報の更新を保留して再描画を要求する。
+// レイアウトとスクロール情報の更新は、次の描画か当たり判定の前に一度だけ行う。
+void FuriganaCtl_impl::request_scroll_info() {
+    m_scroll_info_pending = true;
+    BaseTextBox_impl::invalidate();
+}
+
+// 保留しているスクロール情報の更新と表示位置の調整を行う
+void FuriganaCtl_impl::flush_pending() {
+    if (m_scroll_info_pending) {
+        m_scroll_info_pending = false;
+        update_scroll_info();
+    }
+
+    if (m_visible_part_pending >= 0) {
+        INT iPart = m_visible_part_pending;
+        m_visible_part_pending = -1;
+        ::KillTimer(m_hwnd, TIMER_ID_FLUSH);
+        scroll_to_part(iPart);
+    }
+}
+
+// パートの範囲を囲む長方形をクライアント座標で取得する。レイアウトが最新でなければ失敗する。
+bool FuriganaCtl_impl::get_parts_client_rect(INT iStart, INT iEnd, RECT *prc) {
+    if (m_scroll_info_pending || !m_doc.get_parts_rect(iStart, iEnd, prc))
+        return false;
+    ::OffsetRect(prc, m_margin_rect.left - m_scroll_x, m_margin_rect.top - m_scroll_y);
+    return true;
+}
+
+// 文書の座標の長方形をクライアント座標にして無効にする
+void FuriganaCtl_impl::invalidate_doc_rects(const std::vector<RECT>& rects) {
+    for (size_t i = 0; i < rects.size(); ++i) {
+        RECT rc = rects[i];
+        ::OffsetRect(&rc, m_margin_rect.left - m_scroll_x, m_margin_rect.top - m_scroll_y);
+        ::InvalidateRect(m_hwnd, &rc, FALSE);
+    }
+}
+
+// パートの範囲だけを無効にする。長方形が求まらなければ全体を無効にする。
+void FuriganaCtl_impl::invalidate_parts(INT iStart, INT iEnd) {
+    if (iStart >= iEnd)
+        return;
+
+    std::vector<RECT> rects;
+    if (!m_scroll_info_pending && m_doc.get_parts_rects(iStart, iEnd, rects))
+        invalidate_doc_rects(rects);
+    else
+        BaseTextBox_impl::invalidate();
+}
+
+// 選択範囲だけを無効にする
+void FuriganaCtl_impl::invalidate_selection() {
+    INT iStart = m_doc.m_selection_start, iEnd = m_doc.m_selection_end;
+    m_doc.get_normalized_selection(iStart, iEnd);
+    if (iStart >= 0)
+        invalidate_parts(iStart, iEnd);
+}
+
+// 選択を変更し、選択状態が変わったパートだけを無効にする。レイアウトはやり直さない。
+void FuriganaCtl_impl::set_selection(INT iStart, INT iEnd) {
+    std::vector<RECT> rects;
+    if (m_doc.set_selection(iStart, iEnd, &rects) && !m_scroll_info_pending)
+        invalidate_doc_rects(rects);
+    else
+        BaseTextBox_impl::invalidate();
 }
 
 // 描画フラグ群を取得
@@ -167,12 +275,19 @@ LRESULT FuriganaCtl_impl::OnSetColor(INT iColor, COLORREF rgbColor) {
 
     if (rgbColor == CLR_INVALID) {
         reset_color(iColor);
-        return TRUE;
+    } else {
+        m_colors[iColor] = rgbColor;
+        m_color_is_set[iColor] = true;
     }
 
-    m_colors[iColor] = rgbColor;
-    m_color_is_set[iColor] = true;
-    invalidate();
+    // 色はレイアウトに影響しないので、再描画だけ。選択の色なら選択範囲だけ。
+    m_doc.set_colors(m_colors);
+    if (iColor >= 2) {
+        if (m_doc.m_set_focus)
+            invalidate_selection();
+    } else {
+        BaseTextBox_impl::invalidate();
+    }
     return TRUE;
 }
 
@@ -213,9 +328,9 @@ LRESULT FuriganaCtl_impl::OnGetIdealSize(INT type, RECT *prc) {
 LRESULT FuriganaCtl_impl::OnSetLineGap(INT line_gap) {
     if (line_gap < 0)
         return FALSE;
-    m_doc.m_line_gap = line_gap;
-    m_doc.set_dirty();
-    invalidate();
+    // ランの垂直位置だけが変わる。文書の高さが変わるのでスクロール情報は更新する。
+    m_doc.set_line_gap(line_gap);
+    request_scroll_info();
     return TRUE;
 }
 
@@ -223,13 +338,13 @@ LRESULT FuriganaCtl_impl::OnSetLineGap(INT line_gap) {
 void FuriganaCtl_impl::OnSetFocus(HWND hwnd, HWND hwndOldFocus) {
     m_doc.m_set_focus = true;
     //m_doc.set_selection(0, -1); // DLGC_HASSETSEL
-    invalidate();
+    invalidate_selection(); // 選択の表示だけが変わる
 }
 
 // WM_KILLFOCUS
 void FuriganaCtl_impl::OnKillFocus(HWND hwnd, HWND hwndNewFocus) {
     m_doc.m_set_focus = false;
-    invalidate();
+    invalidate_selection(); // 選択の表示だけが変わる
 }
 
 // WM_SETFONT
@@ -278,7 +393,7 @@ void FuriganaCtl_impl::OnSetFont(HWND hwndCtl, HFONT hfont, BOOL fRedraw) {
 
 // WM_STYLECHANGED
 void FuriganaCtl_impl::OnStyleChanged(HWND hwnd) {
-    m_doc.set_dirty();
+    // 描画フラグの変化は TextDoc が調べる。揃えだけなら水平位置の計算だけで済む。
     invalidate();
 }
 
@@ -324,9 +439,8 @@ void FuriganaCtl_impl::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT f
             // Use iEnd as the active caret position (consistent with Left/Right handling).
             if (iStart == -1 || iEnd == -1) {
                 // nothing selected -> place at start
-                m_doc.set_selection(0, 0);
+                set_selection(0, 0);
                 ensure_visible(0);
-                invalidate();
                 break;
             }
 
@@ -354,15 +468,10 @@ void FuriganaCtl_impl::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT f
                 break;
             }
 
-            // Find which run contains the caret
-            INT runIndex = (INT)m_doc.m_runs.size();
-            for (size_t ri = 0; ri < m_doc.m_runs.size(); ++ri) {
-                const TextRun& run = m_doc.m_runs[ri];
-                if (run.m_part_index_start <= caret && caret < run.m_part_index_end) {
-                    runIndex = (INT)ri;
-                    break;
-                }
-            }
+            // Find which run contains the caret (past the last run at the end of the document)
+            INT runIndex = m_doc.find_run_of_part(caret);
+            if (runIndex == -1)
+                runIndex = (INT)m_doc.m_runs.size();
 
             INT newIndex = 0;
             if (runIndex <= 0) {
@@ -380,14 +489,14 @@ void FuriganaCtl_impl::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT f
                 INT bestPart = prevRun.m_part_index_start;
                 INT bestDist = INT_MAX;
                 for (INT pi = prevRun.m_part_index_start; pi < prevRun.m_part_index_end; ++pi) {
-                    const TextPart &p = m_doc.m_parts[pi];
-                    INT center = current_x + p.m_part_width / 2;
+                    INT part_width = m_doc.m_part_widths[pi];
+                    INT center = current_x + part_width / 2;
                     INT dist = abs(center - desiredX);
                     if (dist < bestDist) {
                         bestDist = dist;
                         bestPart = pi;
                     }
-                    current_x += p.m_part_width;
+                    current_x += part_width;
                 }
                 newIndex = bestPart;
             }
@@ -406,9 +515,8 @@ void FuriganaCtl_impl::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT f
                 iStart = iEnd = newIndex;
             }
 
-            m_doc.set_selection(iStart, iEnd);
+            set_selection(iStart, iEnd);
             ensure_visible(newIndex);
-            invalidate();
         }
         break;
     case VK_DOWN: // ↓
@@ -416,9 +524,8 @@ void FuriganaCtl_impl::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT f
             // Move caret/selection to the nearest part on the next visual line.
             if (iStart == -1 || iEnd == -1) {
                 // place at end
-                m_doc.set_selection(cParts, cParts);
+                set_selection(cParts, cParts);
                 ensure_visible(cParts);
-                invalidate();
                 break;
             }
 
@@ -442,28 +549,14 @@ void FuriganaCtl_impl::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT f
                 break;
             }
 
-            // find run containing caret
-            INT runIndex = (INT)m_doc.m_runs.size();
-            for (size_t ri = 0; ri < m_doc.m_runs.size(); ++ri) {
-                const TextRun& run = m_doc.m_runs[ri];
-                if (run.m_part_index_start <= caret && caret < run.m_part_index_end) {
-                    runIndex = (INT)ri;
-                    break;
-                }
-            }
+            // Find which run contains the caret (past the last run at the end of the document)
+            INT runIndex = m_doc.find_run_of_part(caret);
+            if (runIndex == -1)
+                runIndex = (INT)m_doc.m_runs.size();
 
             INT newIndex = cParts;
-            if (runIndex == -1) {
-                // caret not inside runs (maybe at end) -> go to last part
-                if (!m_doc.m_runs.empty()) {
-                    const TextRun& lastRun = m_doc.m_runs.back();
-                    newIndex = lastRun.m_part_index_end - 1;
-                    if (newIndex < 0) newIndex = 0;
-                } else {
-                    newIndex = 0;
-                }
-            } else if (runIndex >= (INT)m_doc.m_runs.size() - 1) {
-                // already last run -> go to end
+            if (runIndex >= (INT)m_doc.m_runs.size() - 1) {
+                // already on the last run or at the end -> go to end
                 newIndex = cParts;
             } else {
                 const TextRun& nextRun = m_doc.m_runs[runIndex + 1];
@@ -473,14 +566,14 @@ void FuriganaCtl_impl::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT f
                 INT bestPart = nextRun.m_part_index_start;
                 INT bestDist = INT_MAX;
                 for (INT pi = nextRun.m_part_index_start; pi < nextRun.m_part_index_end; ++pi) {
-                    const TextPart &p = m_doc.m_parts[pi];
-                    INT center = current_x + p.m_part_width / 2;
+                    INT part_width = m_doc.m_part_widths[pi];
+                    INT center = current_x + part_width / 2;
                     INT dist = abs(center - desiredX);
                     if (dist < bestDist) {
                         bestDist = dist;
                         bestPart = pi;
                     }
-                    current_x += p.m_part_width;
+                    current_x += part_width;
                 }
                 newIndex = bestPart;
             }
@@ -495,9 +588,8 @@ void FuriganaCtl_impl::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT f
                 iStart = iEnd = newIndex;
             }
 
-            m_doc.set_selection(iStart, iEnd);
+            set_selection(iStart, iEnd);
             ensure_visible(newIndex);
-            invalidate();
         }
         break;
     case VK_HOME: // Home キー
@@ -505,7 +597,7 @@ void FuriganaCtl_impl::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT f
         // FALL THROUGH
     case VK_LEFT: // ←
         if (iStart == -1 || iEnd == -1) {
-            m_doc.set_selection(0, 0);
+            set_selection(0, 0);
             break;
         }
         if (fShift) { // Shiftが押されている？
@@ -529,16 +621,15 @@ void FuriganaCtl_impl::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT f
                 iStart = iEnd;
             }
         }
-        m_doc.set_selection(iStart, iEnd);
+        set_selection(iStart, iEnd);
         ensure_visible(iEnd);
-        invalidate();
         break;
     case VK_END: // End キー
         fCtrl = TRUE;
         // FALL THROUGH
     case VK_RIGHT: // →
         if (iStart == -1 || iEnd == -1) {
-            m_doc.set_selection(cParts, cParts);
+            set_selection(cParts, cParts);
             break;
         }
         if (fShift) { // Shiftが押されている？
@@ -562,9 +653,8 @@ void FuriganaCtl_impl::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT f
                 iEnd = iStart;
             }
         }
-        m_doc.set_selection(iStart, iEnd);
+        set_selection(iStart, iEnd);
         ensure_visible(iEnd);
-        invalidate();
         break;
     default:
         break;
@@ -581,6 +671,141 @@ void FuriganaCtl_impl::OnRButtonDown(HWND hwnd, BOOL fDoubleClick, INT x, INT y,
     SetFocus(hwnd);
 }
 
+// FC_APPENDTEXT
+LRESULT FuriganaCtl_impl::OnAppendText(LPCWSTR pszText) {
+    if (!pszText)
+        return FALSE;
+
+    // 最後の段落から下だけが変わる。その上端を追加の前に求めておく。
+    // 最後の段落が空なら、直前の改行の行から。
+    RECT rcDirty;
+    INT cParts = m_doc.get_part_count();
+    bool partial = false;
+    if (!m_doc.m_paras.empty() && cParts > 0) {
+        INT iFirst = min(m_doc.m_paras.back().m_part_index_start, cParts - 1);
+        partial = get_parts_client_rect(iFirst, cParts, &rcDirty);
+    }
+
+    // 文書全体をやり直さず、最後の段落から解析と折り返しを行う
+    std::wstring text = pszText;
+    m_text += text;
+    m_doc.append_text(text, get_draw_flags());
+
+    if (partial) {
+        RECT rcClient;
+        ::GetClientRect(m_hwnd, &rcClient);
+        rcDirty.left = rcClient.left;
+        rcDirty.right = rcClient.right;
+        rcDirty.bottom = rcClient.bottom;
+        // 見えない位置に追加されても、保留した更新が次の描画で行われるように空にしない
+        rcDirty.top = max(INT(rcClient.top), min(INT(rcDirty.top), INT(rcClient.bottom) - 1));
+        m_scroll_info_pending = true;
+        ::InvalidateRect(m_hwnd, &rcDirty, FALSE);
+    } else {
+        request_scroll_info();
+    }
+    return TRUE;
+}
+
+// FC_HITTEST
+LRESULT FuriganaCtl_impl::OnHitTest(INT x, INT y) {
+    return hit_test(x, y);
+}
+
+// FC_SETRENDERCACHE
+LRESULT FuriganaCtl_impl::OnSetRenderCache(UINT cKB) {
+    UINT old_kb = UINT(m_run_cache.m_max_bytes / 1024);
+    m_run_cache.m_max_bytes = size_t(cKB) * 1024;
+    if (!cKB) {
+        // 無効にしたらメモリを返す
+        m_run_cache.discard();
+        ::KillTimer(m_hwnd, TIMER_ID_PREFETCH);
+    } else {
+        m_run_cache.trim();
+    }
+    return old_kb;
+}
+
+// カウントを get_perf_ticks の単位からマイクロ秒にする
+static ULONGLONG ticks_to_usec(uint64_t ticks) {
+    const uint64_t freq = get_perf_frequency();
+    return (ULONGLONG)(ticks / freq * 1000000 + ticks % freq * 1000000 / freq);
+}
+
+// FC_GETPERFSTATS
+LRESULT FuriganaCtl_impl::OnGetPerfStats(FURIGANA_PERFSTATS *pStats) {
+    if (!pStats || pStats->cbSize < FURIGANA_PERFSTATS_V1_SIZE)
+        return FALSE;
+
+    const TextDocStats& doc_stats = m_doc.m_stats;
+    const GdiDrawStats& draw_stats = m_doc.m_draw_stats;
+    FURIGANA_PERFSTATS stats;
+    ZeroMemory(&stats, sizeof(stats));
+    stats.cbSize = sizeof(stats);
+    stats.parse_calls = doc_stats.m_parse_calls;
+    stats.parts_parsed = doc_stats.m_parts_parsed;
+    stats.measure_calls = doc_stats.m_measure_calls;
+    stats.measurer_calls = doc_stats.m_measurer_calls;
+    stats.update_runs_calls = doc_stats.m_update_runs_calls;
+    stats.runs_produced = doc_stats.m_runs_produced;
+    stats.paint_count = m_paint_count;
+    stats.draw_calls = draw_stats.m_draw_calls;
+    stats.parts_drawn = draw_stats.m_parts_drawn;
+    stats.text_out_calls = draw_stats.m_text_out_calls;
+    stats.fill_rect_calls = draw_stats.m_fill_rect_calls;
+    stats.gdi_calls = draw_stats.m_gdi_calls;
+    stats.parse_usec = ticks_to_usec(doc_stats.m_parse_ticks);
+    stats.measure_usec = ticks_to_usec(doc_stats.m_measure_ticks);
+    stats.wrap_usec = ticks_to_usec(doc_stats.m_wrap_ticks);
+    stats.draw_usec = ticks_to_usec(draw_stats.m_draw_ticks);
+    stats.paint_usec = ticks_to_usec(m_paint_ticks);
+    stats.layout_count = m_doc.m_layout_count;
+    stats.drag_layouts_per_sec = m_drag_layouts_per_sec;
+
+    // 呼び出し側が知っている大きさまでだけ書き込む
+    UINT cbSize = min(pStats->cbSize, UINT(sizeof(stats)));
+    CopyMemory(pStats, &stats, cbSize);
+    pStats->cbSize = cbSize;
+    return TRUE;
+}
+
+// FC_RESETPERFSTATS
+LRESULT FuriganaCtl_impl::OnResetPerfStats() {
+    m_doc.m_stats.reset();
+    m_doc.m_draw_stats.reset();
+    m_paint_count = 0;
+    m_paint_ticks = 0;
+    m_doc.m_layout_count = 0;
+    m_drag_layouts = 0;
+    m_drag_layouts_per_sec = 0;
+    return 0;
+}
+
+// FC_GETPARTPOS
+LRESULT FuriganaCtl_impl::OnGetPartPos(INT iPart, POINT *ppt) {
+    if (!ppt)
+        return FALSE;
+
+    flush_pending();
+
+    RECT rc;
+    ::GetClientRect(m_hwnd, &rc);
+    rc.left += m_margin_rect.left;
+    rc.top += m_margin_rect.top;
+    rc.right -= m_margin_rect.right;
+    rc.bottom -= m_margin_rect.bottom;
+
+    UINT flags = get_draw_flags();
+    INT layout_width = (flags & DT_SINGLELINE) ? MAXLONG : max(0, INT(rc.right - rc.left));
+    if (!m_doc.get_part_position(iPart, layout_width, ppt, flags))
+        return FALSE;
+
+    // 文書の座標からクライアント座標へ
+    ppt->x += m_margin_rect.left - m_scroll_x;
+    ppt->y += m_margin_rect.top - m_scroll_y;
+    return TRUE;
+}
+
 // FC_GETSELTEXT
 LRESULT FuriganaCtl_impl::OnGetSelText(INT cchTextMax, LPWSTR pszText) {
     if (!pszText)
@@ -603,9 +828,7 @@ LRESULT FuriganaCtl_impl::OnGetSel(INT *piStart, INT *piEnd) {
 // FC_SETSEL
 LRESULT FuriganaCtl_impl::OnSetSel(INT iStartSel, INT iEndSel) {
     ::SetFocus(m_hwnd);
-    m_doc.set_selection(iStartSel, iEndSel);
-    m_doc.set_dirty();
-    invalidate();
+    set_selection(iStartSel, iEndSel);
     return TRUE;
 }
 
@@ -767,24 +990,56 @@ void FuriganaCtl_impl::OnCopy(HWND hwnd, INT type) {
  *         - パートが見つからない場合はパート総数
  */
 INT FuriganaCtl_impl::hit_test(INT x, INT y) {
+    // スクロール位置を最新にする
+    flush_pending();
+
     INT draw_x = x - m_margin_rect.left;
     INT draw_y = y - m_margin_rect.top;
     INT doc_x = draw_x + m_scroll_x;
     INT doc_y = draw_y + m_scroll_y;
     INT iPart = m_doc.hit_test(doc_x, doc_y, get_draw_flags());
 #ifndef NDEBUG // デバッグ時のみ
-    std::wstring text;
-    if (iPart < (INT)m_doc.m_parts.size()) {
-        text = m_doc.m_parts[iPart].m_text;
-    }
+    std::wstring text = m_doc.get_part_text(iPart);
     DPRINTF(L"hit_test: %d, \"%ls\"\n", iPart, text.c_str());
 #endif
     return iPart;
 }
 
-// ensure_visible: 指定されたパートがクライアント領域内に入るようにスクロール位置を調整します。
+// ensure_visible: 指定されたパートがクライアント領域内に入るようにスクロール位置の調整を要求します。
+// 実際の調整は次の描画か当たり判定の前に一度だけ行います（キーリピートやドラッグ中の連続した要求をまとめる）。
+// ここでは再描画を要求しません。スクロール位置が変わったときだけ scroll_client が見えるようになった部分を無効にします。
 // iPart: パートインデックス（m_doc.m_parts のインデックス）
 void FuriganaCtl_impl::ensure_visible(INT iPart) {
+    FURIGANA_TRACE_SCOPE("FuriganaCtl_impl::ensure_visible");
+    if (iPart < 0)
+        iPart = 0;
+
+    // パートが既にページ内に見えていれば、スクロールも再描画も要らない
+    RECT rcPart, rcPage;
+    if (iPart < m_doc.get_part_count() && get_parts_client_rect(iPart, iPart + 1, &rcPart)) {
+        ::GetClientRect(m_hwnd, &rcPage);
+        rcPage.left += m_margin_rect.left;
+        rcPage.top += m_margin_rect.top;
+        rcPage.right -= m_margin_rect.right;
+        rcPage.bottom -= m_margin_rect.bottom;
+        if (rcPage.left <= rcPart.left && rcPart.right <= rcPage.right &&
+            rcPage.top <= rcPart.top && rcPart.bottom <= rcPage.bottom)
+        {
+            m_visible_part_pending = -1;
+            return;
+        }
+    }
+
+    // 他に無効な領域がなくても調整されるように、タイマーで一度だけ flush_pending を呼ぶ
+    if (m_visible_part_pending < 0)
+        ::SetTimer(m_hwnd, TIMER_ID_FLUSH, FLUSH_DELAY, NULL);
+    m_visible_part_pending = iPart;
+}
+
+// scroll_to_part: 指定されたパートがクライアント領域内に入るようにスクロール位置を調整します。
+// iPart: パートインデックス（m_doc.m_parts のインデックス）
+void FuriganaCtl_impl::scroll_to_part(INT iPart) {
+    FURIGANA_TRACE_SCOPE("FuriganaCtl_impl::scroll_to_part");
     if (iPart < 0)
         iPart = 0;
     if (iPart >= (INT)m_doc.m_parts.size())
@@ -811,15 +1066,9 @@ void FuriganaCtl_impl::ensure_visible(INT iPart) {
     // run 高さとパート幅を取得（垂直スクロール調整に使用）
     INT part_width = 0, run_height = 0;
     if (iPart < (INT)m_doc.m_parts.size()) {
-        part_width = m_doc.m_parts[iPart].m_part_width;
-        run_height = 0;
-        for (size_t ri = 0; ri < m_doc.m_runs.size(); ++ri) {
-            const TextRun& run = m_doc.m_runs[ri];
-            if (run.m_part_index_start <= iPart && iPart < run.m_part_index_end) {
-                run_height = run.m_run_height;
-                break;
-            }
-        }
+        part_width = m_doc.m_part_widths[iPart];
+        INT iRun = m_doc.find_run_of_part(iPart);
+        run_height = (iRun >= 0) ? m_doc.m_runs[iRun].m_run_height : 0;
     }
 
     // 現在のページサイズ
@@ -877,14 +1126,13 @@ void FuriganaCtl_impl::ensure_visible(INT iPart) {
     if (new_scroll_y > maxV) new_scroll_y = maxV;
 
     // 変更があれば反映
-    bool changed = false;
+    INT old_scroll_x = m_scroll_x, old_scroll_y = m_scroll_y;
     if (new_scroll_x != m_scroll_x) {
         m_scroll_x = new_scroll_x;
         SCROLLINFO si = { sizeof(si) };
         si.fMask = SIF_POS;
         si.nPos = m_scroll_x;
         ::SetScrollInfo(m_hwnd, SB_HORZ, &si, TRUE);
-        changed = true;
     }
     if (new_scroll_y != m_scroll_y) {
         m_scroll_y = new_scroll_y;
@@ -892,11 +1140,9 @@ void FuriganaCtl_impl::ensure_visible(INT iPart) {
         si.fMask = SIF_POS;
         si.nPos = m_scroll_y;
         ::SetScrollInfo(m_hwnd, SB_VERT, &si, TRUE);
-        changed = true;
     }
 
-    if (changed)
-        invalidate();
+    scroll_client(old_scroll_x, old_scroll_y);
 }
 
 // WM_LBUTTONDOWN
@@ -905,9 +1151,12 @@ void FuriganaCtl_impl::OnLButtonDown(HWND hwnd, BOOL fDoubleClick, INT x, INT y,
     SetFocus(hwnd);
     SetCapture(hwnd);
 
+    // ドラッグ中の折り返し回数を数え始める
+    m_drag_tick = ::GetTickCount();
+    m_drag_layouts = m_doc.m_layout_count;
+
     INT iPart = hit_test(x, y);
-    m_doc.set_selection(iPart, iPart);
-    invalidate();
+    set_selection(iPart, iPart);
 }
 
 // WM_MOUSEMOVE
@@ -918,10 +1167,17 @@ void FuriganaCtl_impl::OnMouseMove(HWND hwnd, INT x, INT y, UINT keyFlags) {
     }
 
     INT iPart = hit_test(x, y);
-    m_doc.set_selection(m_doc.m_selection_start, iPart);
+    set_selection(m_doc.m_selection_start, iPart);
     ensure_visible(iPart);
 
-    invalidate();
+    // 1秒ごとに折り返しの回数を記録する (FC_GETPERFSTATS)
+    DWORD tick = ::GetTickCount();
+    if (tick - m_drag_tick >= 1000) {
+        m_drag_layouts_per_sec = (m_doc.m_layout_count - m_drag_layouts) * 1000 / (tick - m_drag_tick);
+        DPRINTF(L"[drag] layouts/sec: %lu\n", m_drag_layouts_per_sec);
+        m_drag_tick = tick;
+        m_drag_layouts = m_doc.m_layout_count;
+    }
 }
 
 // WM_LBUTTONUP
@@ -932,11 +1188,10 @@ void FuriganaCtl_impl::OnLButtonUp(HWND hwnd, INT x, INT y, UINT keyFlags) {
     }
 
     INT iPart = hit_test(x, y);
-    m_doc.set_selection(m_doc.m_selection_start, iPart);
+    set_selection(m_doc.m_selection_start, iPart);
     ensure_visible(iPart);
 
     ::ReleaseCapture();
-    invalidate();
 }
 
 // WM_SYSCOLORCHANGE
@@ -946,22 +1201,29 @@ void FuriganaCtl_impl::OnSysColorChange(HWND hwnd) {
     if (!m_color_is_set[iColor]) OnSetColor(iColor, CLR_INVALID); ++iColor;
     if (!m_color_is_set[iColor]) OnSetColor(iColor, CLR_INVALID); ++iColor;
     if (!m_color_is_set[iColor]) OnSetColor(iColor, CLR_INVALID);
-    invalidate();
+}
+
+// WM_DISPLAYCHANGE
+void FuriganaCtl_impl::OnDisplayChange(HWND hwnd, UINT bitsPerPixel, UINT cxScreen, UINT cyScreen) {
+    // 色深度が変わったかもしれないので裏画面とランのキャッシュを作り直す
+    discard_back_buffer();
+    m_run_cache.discard();
+    ::InvalidateRect(hwnd, NULL, FALSE);
 }
 
 // WM_SIZE
 void FuriganaCtl_impl::OnSize(HWND hwnd, UINT state, INT cx, INT cy) {
-    update_scroll_info();
+    // 裏画面は次の描画で新しい大きさで作り直す
+    discard_back_buffer();
 
-    m_scroll_x = ::GetScrollPos(hwnd, SB_HORZ);
-    m_scroll_y = ::GetScrollPos(hwnd, SB_VERT);
-
-    m_doc.set_dirty();
-    invalidate();
+    // スクロール位置は、保留したスクロール情報の更新で取得し直す
+    request_scroll_info();
 }
 
 // WM_HSCROLL
 void FuriganaCtl_impl::OnHScroll(HWND hwnd, HWND hwndCtl, UINT code, INT pos) {
+    flush_pending();
+
     SCROLLINFO si = { sizeof(si) };
     si.fMask = SIF_ALL;
     ::GetScrollInfo(hwnd, SB_HORZ, &si);
@@ -996,17 +1258,19 @@ void FuriganaCtl_impl::OnHScroll(HWND hwnd, HWND hwndCtl, UINT code, INT pos) {
     }
 
     if (nPos != si.nPos) {
+        INT old_scroll_x = m_scroll_x;
         m_scroll_x = nPos;
         si.fMask = SIF_POS;
         si.nPos = nPos;
         ::SetScrollInfo(hwnd, SB_HORZ, &si, FALSE);
-        m_doc.set_dirty();
-        invalidate();
+        scroll_client(old_scroll_x, m_scroll_y);
     }
 }
 
 // WM_VSCROLL
 void FuriganaCtl_impl::OnVScroll(HWND hwnd, HWND hwndCtl, UINT code, INT pos) {
+    flush_pending();
+
     SCROLLINFO si = { sizeof(si) };
     si.fMask = SIF_ALL;
     ::GetScrollInfo(hwnd, SB_VERT, &si);
@@ -1041,17 +1305,22 @@ void FuriganaCtl_impl::OnVScroll(HWND hwnd, HWND hwndCtl, UINT code, INT pos) {
     }
 
     if (nPos != si.nPos) {
+        INT old_scroll_y = m_scroll_y;
         m_scroll_y = nPos;
         si.fMask = SIF_POS;
         si.nPos = nPos;
         ::SetScrollInfo(hwnd, SB_VERT, &si, FALSE);
-        m_doc.set_dirty();
-        invalidate();
+        scroll_client(m_scroll_x, old_scroll_y);
     }
 }
 
 // WM_PAINT
 void FuriganaCtl_impl::OnPaint(HWND hwnd) {
+    const uint64_t start_ticks = get_perf_ticks();
+
+    // 保留している更新を描画の前に一度だけ行う（更新領域が広がることがある）
+    flush_pending();
+
     PAINTSTRUCT ps;
     HDC dc = ::BeginPaint(hwnd, &ps);
     if (!dc) return;
@@ -1066,50 +1335,124 @@ void FuriganaCtl_impl::OnPaint(HWND hwnd) {
         return;
     }
 
-    // メモリDCの作成（ダブルバッファ）
-    HDC memDC = ::CreateCompatibleDC(dc); // DC作成
+    // 裏画面（ダブルバッファ）。大きさか色深度が変わったときだけ作り直す
+    HDC memDC = ensure_back_buffer(dc, cx, cy);
     if (!memDC) {
         ::EndPaint(hwnd, &ps);
         return;
     }
 
+    // 内部描画（更新領域の外は描かない）
+    ::IntersectClipRect(memDC, ps.rcPaint.left, ps.rcPaint.top, ps.rcPaint.right, ps.rcPaint.bottom);
+    paint_inner(hwnd, memDC, &rcClient);
+    ::SelectClipRgn(memDC, NULL);
+
+    // 更新領域だけをビットブロットで画面へ転送
+    ::BitBlt(dc, ps.rcPaint.left, ps.rcPaint.top,
+             ps.rcPaint.right - ps.rcPaint.left, ps.rcPaint.bottom - ps.rcPaint.top,
+             memDC, ps.rcPaint.left, ps.rcPaint.top, SRCCOPY);
+
+    ::EndPaint(hwnd, &ps);
+
+    ++m_paint_count;
+    m_paint_ticks += get_perf_ticks() - start_ticks;
+
+    // 手が空いたら次のページを描いておく
+    if (m_run_cache.m_max_bytes)
+        ::SetTimer(hwnd, TIMER_ID_PREFETCH, PREFETCH_DELAY, NULL);
+}
+
+// WM_TIMER
+void FuriganaCtl_impl::OnTimer(HWND hwnd, UINT id) {
+    if (id == TIMER_ID_FLUSH) {
+        ::KillTimer(hwnd, id);
+        flush_pending();
+        return;
+    }
+    if (id != TIMER_ID_PREFETCH)
+        return;
+
+    ::KillTimer(hwnd, id);
+
+    // 入力を待たせない
+    if (HIWORD(::GetQueueStatus(QS_INPUT))) {
+        ::SetTimer(hwnd, TIMER_ID_PREFETCH, PREFETCH_DELAY, NULL);
+        return;
+    }
+
+    prefetch_runs();
+}
+
+/**
+ * 裏画面のメモリDCを取得する。なければ作り、大きさか色深度が変わっていれば作り直す。
+ * @param dc 画面のDC。
+ * @param cx 必要な幅。
+ * @param cy 必要な高さ。
+ * @return メモリDC。作れなければ NULL。
+ */
+HDC FuriganaCtl_impl::ensure_back_buffer(HDC dc, INT cx, INT cy) {
+    INT bpp = ::GetDeviceCaps(dc, BITSPIXEL) * ::GetDeviceCaps(dc, PLANES);
+    if (m_back_dc && m_back_cx == cx && m_back_cy == cy && m_back_bpp == bpp)
+        return m_back_dc;
+
+    discard_back_buffer();
+
+    HDC memDC = ::CreateCompatibleDC(dc); // DC作成
+    if (!memDC)
+        return NULL;
+
     HBITMAP hbm = ::CreateCompatibleBitmap(dc, cx, cy); // ビットマップ作成
     if (!hbm) {
         ::DeleteDC(memDC);
-        ::EndPaint(hwnd, &ps);
-        return;
+        return NULL;
     }
 
-    HGDIOBJ oldBmp = SelectObject(memDC, hbm); // ビットマップ選択
+    HGDIOBJ oldBmp = ::SelectObject(memDC, hbm); // ビットマップ選択
     if (!oldBmp) {
         ::DeleteObject(hbm);
         ::DeleteDC(memDC);
-        ::EndPaint(hwnd, &ps);
-        return;
+        return NULL;
     }
 
-    // 内部描画
-    paint_inner(hwnd, memDC, &rcClient);
-
-    // ビットブロットで画面へ転送
-    BitBlt(dc, 0, 0, cx, cy, memDC, 0, 0, SRCCOPY);
-
-    // 後片付け
-    SelectObject(memDC, oldBmp);
-    DeleteObject(hbm);
-    DeleteDC(memDC);
+    m_back_dc = memDC;
+    m_back_bitmap = hbm;
+    m_back_old_bitmap = oldBmp;
+    m_back_cx = cx;
+    m_back_cy = cy;
+    m_back_bpp = bpp;
+    return m_back_dc;
+}
 
-    ::EndPaint(hwnd, &ps);
+// 裏画面を破棄する。次の描画で作り直される。
+void FuriganaCtl_impl::discard_back_buffer() {
+    if (m_back_dc) {
+        ::SelectObject(m_back_dc, m_back_old_bitmap);
+        ::DeleteDC(m_back_dc);
+        m_back_dc = NULL;
+        m_back_old_bitmap = NULL;
+    }
+    if (m_back_bitmap) {
+        ::DeleteObject(m_back_bitmap);
+        m_back_bitmap = NULL;
+    }
+    m_back_cx = m_back_cy = 0;
+    m_back_bpp = 0;
 }
 
 // 描画する
 void FuriganaCtl_impl::paint_inner(HWND hwnd, HDC dc, RECT *rect) {
     RECT rc = *rect;
 
-    // 背景を塗りつぶす
-    HBRUSH hBrush = ::CreateSolidBrush(m_colors[1]);
-    ::FillRect(dc, &rc, hBrush);
-    ::DeleteObject(hBrush);
+    // 更新が必要な部分（クリップ領域）だけを描く
+    RECT rcVisible;
+    if (::GetClipBox(dc, &rcVisible) == NULLREGION)
+        return;
+    if (!::IntersectRect(&rcVisible, &rcVisible, rect))
+        return;
+
+    // 背景を塗りつぶす（ブラシは文書が色の変更時だけ作り直す）
+    ::FillRect(dc, &rcVisible, m_doc.get_back_brush());
+    ++m_doc.m_draw_stats.m_fill_rect_calls;
 
     // 余白を空ける
     rc.left += m_margin_rect.left;
@@ -1120,8 +1463,274 @@ void FuriganaCtl_impl::paint_inner(HWND hwnd, HDC dc, RECT *rect) {
     // スクロールを反映する
     ::OffsetRect(&rc, -m_scroll_x, -m_scroll_y);
 
-    // 描画
-    m_doc.draw_doc(dc, &rc, get_draw_flags(), m_colors);
+    // 描画（見えているランだけ）。キャッシュが有効ならランのビットマップを転送する
+    UINT flags = get_draw_flags();
+    if (!paint_cached_runs(dc, &rc, &rcVisible, flags))
+        m_doc.draw_doc(dc, &rc, flags, NULL, &rcVisible);
+}
+
+/**
+ * 描画済みのランのキャッシュを使って、見えているランを描く。
+ * キャッシュにないか古いランだけを描き直す。
+ * @param dc 描画先。背景は塗りつぶし済みであること。
+ * @param prc 文書を描く位置（余白とスクロールを反映したもの）。
+ * @param prcVisible 実際に見える領域（dc の座標）。
+ * @param flags 描画フラグ。
+ * @return キャッシュが無効なら FALSE。何も描かない。
+ */
+bool FuriganaCtl_impl::paint_cached_runs(HDC dc, RECT *prc, const RECT *prcVisible, UINT flags) {
+    if (!m_run_cache.m_max_bytes)
+        return false;
+
+    // レイアウトを最新にしてから、古いビットマップを捨てる
+    INT layout_width = prc->right - prc->left;
+    m_doc.prepare_layout(layout_width, flags);
+    UINT stamp = m_doc.get_render_stamp();
+    if (m_run_cache.m_stamp != stamp) {
+        m_run_cache.clear();
+        m_run_cache.m_stamp = stamp;
+    }
+
+    // 見える範囲のラン
+    INT cRuns = (INT)m_doc.m_runs.size();
+    INT iFirstRun = m_doc.find_run_by_y(prcVisible->top - prc->top);
+    INT iLastRun = m_doc.find_run_by_y(prcVisible->bottom - prc->top);
+    if (iLastRun < cRuns && prc->top + m_doc.m_runs[iLastRun].m_top < prcVisible->bottom)
+        ++iLastRun; // 下端にかかっているラン
+
+    for (INT iRun = iFirstRun; iRun < iLastRun; ++iRun) {
+        const TextRun& run = m_doc.m_runs[iRun];
+        if (run.m_part_index_start == run.m_part_index_end)
+            continue; // 空のラン。背景は塗りつぶし済み
+
+        INT x = prc->left, y = prc->top + run.m_top;
+        const RunBitmap *entry = get_run_bitmap(dc, iRun, layout_width, flags);
+        if (entry) {
+            HDC memDC = m_run_cache.select(dc, entry->m_hbm);
+            ::BitBlt(dc, x, y, entry->m_cx, entry->m_cy, memDC, 0, 0, SRCCOPY);
+            m_run_cache.unselect();
+        } else {
+            // キャッシュできないランはそのまま描く
+            RECT rcRun = { prcVisible->left, y, prcVisible->right, y + run.m_run_height };
+            if (::IntersectRect(&rcRun, &rcRun, prcVisible))
+                m_doc.draw_doc(dc, prc, flags, NULL, &rcRun);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * ランのビットマップを取得する。キャッシュになければ描いて追加する。
+ * ビットマップの左端は文書の左端、上端はランの上端。
+ * @param dcCompat 互換ビットマップを作るためのDC。
+ * @param iRun ランのインデックス。
+ * @param layout_width 折り返し幅。
+ * @param flags 描画フラグ。
+ * @return キャッシュの要素。大きすぎるか作れなければ NULL。
+ */
+const RunBitmap *FuriganaCtl_impl::get_run_bitmap(HDC dcCompat, INT iRun, INT layout_width, UINT flags) {
+    const TextRun& run = m_doc.m_runs[iRun];
+
+    // ランと重なる選択範囲。フォーカスがなければ選択は描かれない
+    INT sel_start = -1, sel_end = -1;
+    if (m_doc.m_set_focus) {
+        INT iStart = m_doc.m_selection_start, iEnd = m_doc.m_selection_end;
+        m_doc.get_normalized_selection(iStart, iEnd);
+        if (iStart != -1) {
+            sel_start = max(iStart, run.m_part_index_start);
+            sel_end = min(iEnd, run.m_part_index_end);
+            if (sel_start >= sel_end)
+                sel_start = sel_end = -1;
+        }
+    }
+
+    RunBitmap *entry = m_run_cache.find(run.m_part_index_start);
+    if (entry) {
+        if (entry->m_part_end == run.m_part_index_end &&
+            entry->m_sel_start == sel_start && entry->m_sel_end == sel_end &&
+            entry->m_cy == run.m_run_height)
+        {
+            return entry;
+        }
+        m_run_cache.erase(run.m_part_index_start);
+    }
+
+    // 幅が広すぎるランや、上限に比べて大きすぎるランはキャッシュしない
+    INT cx = run.m_delta_x + run.m_run_width, cy = run.m_run_height;
+    if (run.m_delta_x < 0 || cx <= 0 || cy <= 0 || cx > MAX_RUN_BITMAP_WIDTH)
+        return NULL;
+    if (size_t(cx) * cy * 4 > m_run_cache.m_max_bytes / 4)
+        return NULL;
+
+    HBITMAP hbm = ::CreateCompatibleBitmap(dcCompat, cx, cy);
+    if (!hbm)
+        return NULL;
+
+    HDC memDC = m_run_cache.select(dcCompat, hbm);
+    if (!memDC) {
+        ::DeleteObject(hbm);
+        return NULL;
+    }
+
+    // ランだけが見えるように文書を置いて描く
+    RECT rcBitmap = { 0, 0, cx, cy };
+    ::FillRect(memDC, &rcBitmap, m_doc.get_back_brush());
+    ++m_doc.m_draw_stats.m_fill_rect_calls;
+    RECT rcDoc = { 0, -run.m_top, layout_width, cy - run.m_top };
+    m_doc.draw_doc(memDC, &rcDoc, flags, NULL, &rcBitmap);
+    m_run_cache.unselect();
+
+    RunBitmap new_entry;
+    new_entry.m_part_start = run.m_part_index_start;
+    new_entry.m_part_end = run.m_part_index_end;
+    new_entry.m_sel_start = sel_start;
+    new_entry.m_sel_end = sel_end;
+    new_entry.m_cx = cx;
+    new_entry.m_cy = cy;
+    new_entry.m_hbm = hbm;
+    return m_run_cache.add(new_entry);
+}
+
+// 次のページのランを描いてキャッシュに入れておく。
+void FuriganaCtl_impl::prefetch_runs() {
+    if (!m_run_cache.m_max_bytes)
+        return;
+
+    flush_pending();
+
+    RECT rc;
+    ::GetClientRect(m_hwnd, &rc);
+    rc.left += m_margin_rect.left;
+    rc.top += m_margin_rect.top;
+    rc.right -= m_margin_rect.right;
+    rc.bottom -= m_margin_rect.bottom;
+    INT page_height = rc.bottom - rc.top;
+    if (rc.right <= rc.left || page_height <= 0)
+        return;
+
+    HDC dc = ::GetDC(m_hwnd);
+    if (!dc)
+        return;
+
+    INT layout_width = rc.right - rc.left;
+    UINT flags = get_draw_flags();
+    m_doc.prepare_layout(layout_width, flags);
+    UINT stamp = m_doc.get_render_stamp();
+    if (m_run_cache.m_stamp != stamp) {
+        m_run_cache.clear();
+        m_run_cache.m_stamp = stamp;
+    }
+
+    // 今のページのすぐ下から1ページ分
+    INT cRuns = (INT)m_doc.m_runs.size();
+    INT iFirstRun = m_doc.find_run_by_y(m_scroll_y + page_height);
+    INT iLastRun = min(cRuns, m_doc.find_run_by_y(m_scroll_y + 2 * page_height) + 1);
+    for (INT iRun = iFirstRun; iRun < iLastRun; ++iRun) {
+        // 入力が来たら後回しにする
+        if (HIWORD(::GetQueueStatus(QS_INPUT))) {
+            ::SetTimer(m_hwnd, TIMER_ID_PREFETCH, PREFETCH_DELAY, NULL);
+            break;
+        }
+
+        const TextRun& run = m_doc.m_runs[iRun];
+        if (run.m_part_index_start == run.m_part_index_end)
+            continue;
+
+        // 追加すると上限を超えるならやめる。add() の trim() で見えているランが追い出されてしまう
+        INT cx = run.m_delta_x + run.m_run_width, cy = run.m_run_height;
+        if (cx > 0 && cy > 0 &&
+            m_run_cache.m_bytes + size_t(cx) * cy * 4 > m_run_cache.m_max_bytes)
+        {
+            break;
+        }
+
+        get_run_bitmap(dc, iRun, layout_width, flags);
+    }
+
+    ::ReleaseDC(m_hwnd, dc);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// RunBitmapCache
+
+// すべてのビットマップを捨てる。
+void RunBitmapCache::clear() {
+    unselect();
+    for (list_type::iterator it = m_lru.begin(); it != m_lru.end(); ++it) {
+        ::DeleteObject(it->m_hbm);
+    }
+    m_lru.clear();
+    m_map.clear();
+    m_bytes = 0;
+}
+
+// すべてのビットマップとメモリDCを捨てる。
+void RunBitmapCache::discard() {
+    clear();
+    if (m_dc) {
+        ::DeleteDC(m_dc);
+        m_dc = NULL;
+        m_old_bitmap = NULL;
+    }
+}
+
+// 開始パートでビットマップを探す。見つかれば最近使ったものにする。
+RunBitmap *RunBitmapCache::find(INT part_start) {
+    std::map<INT, list_type::iterator>::iterator found = m_map.find(part_start);
+    if (found == m_map.end())
+        return NULL;
+    m_lru.splice(m_lru.begin(), m_lru, found->second);
+    return &*found->second;
+}
+
+// 開始パートのビットマップを捨てる。
+void RunBitmapCache::erase(INT part_start) {
+    std::map<INT, list_type::iterator>::iterator found = m_map.find(part_start);
+    if (found == m_map.end())
+        return;
+    unselect();
+    m_bytes -= size_t(found->second->m_cx) * found->second->m_cy * 4;
+    ::DeleteObject(found->second->m_hbm);
+    m_lru.erase(found->second);
+    m_map.erase(found);
+}
+
+// ビットマップを追加する。ビットマップの所有権はキャッシュに移る。
+RunBitmap *RunBitmapCache::add(const RunBitmap& entry) {
+    erase(entry.m_part_start);
+    m_lru.push_front(entry);
+    m_map[entry.m_part_start] = m_lru.begin();
+    m_bytes += size_t(entry.m_cx) * entry.m_cy * 4;
+    trim();
+    return &m_lru.front();
+}
+
+// 上限を超えた分を、使われていない順に捨てる。最後に使ったものは残す。
+void RunBitmapCache::trim() {
+    while (m_bytes > m_max_bytes && m_lru.size() > 1) {
+        erase(m_lru.back().m_part_start);
+    }
+    if (!m_max_bytes)
+        clear();
+}
+
+// ビットマップをメモリDCに選択する。メモリDCがなければ作る。
+HDC RunBitmapCache::select(HDC dcCompat, HBITMAP hbm) {
+    if (!m_dc) {
+        m_dc = ::CreateCompatibleDC(dcCompat);
+        if (!m_dc)
+            return NULL;
+        m_old_bitmap = ::GetCurrentObject(m_dc, OBJ_BITMAP);
+    }
+    ::SelectObject(m_dc, hbm);
+    return m_dc;
+}
+
+// メモリDCに元のビットマップを戻す。選択中のビットマップを消す前に呼ぶ。
+void RunBitmapCache::unselect() {
+    if (m_dc)
+        ::SelectObject(m_dc, m_old_bitmap);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1163,13 +1772,66 @@ BOOL FuriganaCtl::unregister_class(HINSTANCE inst) {
     return ::UnregisterClassW(get_class_name(), inst);
 }
 
+#ifdef FURIGANA_TRACE
+// トレースのスパン名。処理しないメッセージは NULL（記録しない）
+static const char *get_trace_message_name(UINT uMsg) {
+    switch (uMsg) {
+    case WM_CREATE: return "WM_CREATE";
+    case WM_DESTROY: return "WM_DESTROY";
+    case WM_PAINT: return "WM_PAINT";
+    case WM_PRINTCLIENT: return "WM_PRINTCLIENT";
+    case WM_SIZE: return "WM_SIZE";
+    case WM_DISPLAYCHANGE: return "WM_DISPLAYCHANGE";
+    case WM_TIMER: return "WM_TIMER";
+    case WM_LBUTTONDOWN: return "WM_LBUTTONDOWN";
+    case WM_MOUSEMOVE: return "WM_MOUSEMOVE";
+    case WM_LBUTTONUP: return "WM_LBUTTONUP";
+    case WM_RBUTTONUP: return "WM_RBUTTONUP";
+    case WM_SYSCOLORCHANGE: return "WM_SYSCOLORCHANGE";
+    case WM_MOUSEWHEEL: return "WM_MOUSEWHEEL";
+    case WM_CONTEXTMENU: return "WM_CONTEXTMENU";
+    case WM_KEYDOWN: return "WM_KEYDOWN";
+    case WM_HSCROLL: return "WM_HSCROLL";
+    case WM_VSCROLL: return "WM_VSCROLL";
+    case WM_SETFONT: return "WM_SETFONT";
+    case WM_SETFOCUS: return "WM_SETFOCUS";
+    case WM_KILLFOCUS: return "WM_KILLFOCUS";
+    case WM_SETTEXT: return "WM_SETTEXT";
+    case WM_GETTEXT: return "WM_GETTEXT";
+    case WM_GETDLGCODE: return "WM_GETDLGCODE";
+    case WM_COPY: return "WM_COPY";
+    case WM_STYLECHANGED: return "WM_STYLECHANGED";
+    case WM_DPICHANGED_AFTERPARENT: return "WM_DPICHANGED_AFTERPARENT";
+    case FC_SETRUBYRATIO: return "FC_SETRUBYRATIO";
+    case FC_SETMARGIN: return "FC_SETMARGIN";
+    case FC_SETCOLOR: return "FC_SETCOLOR";
+    case FC_SETLINEGAP: return "FC_SETLINEGAP";
+    case FC_GETIDEALSIZE: return "FC_GETIDEALSIZE";
+    case FC_SETSEL: return "FC_SETSEL";
+    case FC_GETSELTEXT: return "FC_GETSELTEXT";
+    case FC_GETSEL: return "FC_GETSEL";
+    case FC_APPENDTEXT: return "FC_APPENDTEXT";
+    case FC_HITTEST: return "FC_HITTEST";
+    case FC_GETPARTPOS: return "FC_GETPARTPOS";
+    case FC_SETRENDERCACHE: return "FC_SETRENDERCACHE";
+    case FC_GETPERFSTATS: return "FC_GETPERFSTATS";
+    case FC_RESETPERFSTATS: return "FC_RESETPERFSTATS";
+    default: return NULL;
+    }
+}
+#endif
+
 // 内部ウィンドウ プロシージャ
 LRESULT CALLBACK FuriganaCtl::window_proc_inner(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
+    FURIGANA_TRACE_SCOPE(get_trace_message_name(uMsg));
     FuriganaCtl_impl *pImpl = pimpl();
     if (!pImpl)
         return BaseTextBox::window_proc_inner(hwnd, uMsg, wParam, lParam);
     switch (uMsg) {
         HANDLE_MSG(hwnd, WM_PAINT, pImpl->OnPaint);
+        HANDLE_MSG(hwnd, WM_SIZE, pImpl->OnSize);
+        HANDLE_MSG(hwnd, WM_DISPLAYCHANGE, pImpl->OnDisplayChange);
+        HANDLE_MSG(hwnd, WM_TIMER, pImpl->OnTimer);
         HANDLE_MSG(hwnd, WM_LBUTTONDOWN, pImpl->OnLButtonDown);
         HANDLE_MSG(hwnd, WM_MOUSEMOVE, pImpl->OnMouseMove);
         HANDLE_MSG(hwnd, WM_LBUTTONUP, pImpl->OnLButtonUp);
@@ -1190,6 +1852,10 @@ LRESULT CALLBACK FuriganaCtl::window_proc_inner(HWND hwnd, UINT uMsg, WPARAM wPa
     case WM_STYLECHANGED:
         pImpl->OnStyleChanged(hwnd);
         break;
+    case WM_DPICHANGED_AFTERPARENT:
+        pImpl->discard_back_buffer();
+        ::InvalidateRect(hwnd, NULL, FALSE);
+        break;
     case FC_SETRUBYRATIO:
         return pImpl->OnSetRubyRatio((INT)wParam, (INT)lParam);
     case FC_SETMARGIN:
@@ -1206,6 +1872,18 @@ LRESULT CALLBACK FuriganaCtl::window_proc_inner(HWND hwnd, UINT uMsg, WPARAM wPa
         return pImpl->OnGetSelText((INT)wParam, (LPWSTR)lParam);
     case FC_GETSEL:
         return pImpl->OnGetSel((INT *)wParam, (INT *)lParam);
+    case FC_APPENDTEXT:
+        return pImpl->OnAppendText((LPCWSTR)lParam);
+    case FC_HITTEST:
+        return pImpl->OnHitTest(GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam));
+    case FC_GETPARTPOS:
+        return pImpl->OnGetPartPos((INT)wParam, (POINT *)lParam);
+    case FC_SETRENDERCACHE:
+        return pImpl->OnSetRenderCache((UINT)wParam);
+    case FC_GETPERFSTATS:
+        return pImpl->OnGetPerfStats((FURIGANA_PERFSTATS *)lParam);
+    case FC_RESETPERFSTATS:
+        return pImpl->OnResetPerfStats();
     default:
         return BaseTextBox::window_proc_inner(hwnd, uMsg, wParam, lParam);
     }
@@ -3,6 +3,54 @@
 #include "../BaseTextBox/BaseTextBox_impl.h"
 #include "../furigana_gdi/furigana_gdi.h"
 #include "furigana_api.h"
+#include <list>
+
+//////////////////////////////////////////////////////////////////////////////
+// RunBitmap - 描画済みのランのビットマップ
+
+struct RunBitmap {
+    INT m_part_start; // ランの開始パート（キー）
+    INT m_part_end;   // ランの終了パート
+    INT m_sel_start;  // 描いたときにランと重なっていた選択範囲。なければ -1
+    INT m_sel_end;
+    INT m_cx, m_cy;   // ビットマップの大きさ
+    HBITMAP m_hbm;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// RunBitmapCache - 描画済みのランのビットマップのキャッシュ（LRU）
+// 文書の描画世代 (GdiTextDoc::get_render_stamp) が変わったらすべて捨てる。
+
+struct RunBitmapCache {
+    typedef std::list<RunBitmap> list_type;
+    list_type m_lru;                                // 先頭ほど最近使った
+    std::map<INT, list_type::iterator> m_map;       // 開始パートから m_lru の要素へ
+    UINT m_stamp;       // ビットマップを描いたときの文書の描画世代
+    size_t m_bytes;     // ビットマップの合計バイト数（概算）
+    size_t m_max_bytes; // 合計バイト数の上限。0 ならキャッシュしない
+    HDC m_dc;           // ビットマップを選択するメモリDC
+    HGDIOBJ m_old_bitmap; // m_dc に元々選択されていたビットマップ
+
+    RunBitmapCache() {
+        m_stamp = 0;
+        m_bytes = 0;
+        m_max_bytes = 0;
+        m_dc = NULL;
+        m_old_bitmap = NULL;
+    }
+    ~RunBitmapCache() {
+        discard();
+    }
+
+    void clear();
+    void discard();
+    RunBitmap *find(INT part_start);
+    void erase(INT part_start);
+    RunBitmap *add(const RunBitmap& entry);
+    void trim();
+    HDC select(HDC dcCompat, HBITMAP hbm);
+    void unselect();
+};
 
 //////////////////////////////////////////////////////////////////////////////
 // FuriganaCtl_impl
@@ -17,9 +65,30 @@ struct FuriganaCtl_impl : BaseTextBox_impl {
     INT m_scroll_step_x;
     INT m_scroll_step_y;
     RECT m_margin_rect;
-    TextDoc m_doc;
+    GdiTextDoc m_doc;
     COLORREF m_colors[4];
     bool m_color_is_set[4];
+    bool m_scroll_info_pending; // スクロール情報の更新を保留しているか？
+    INT m_visible_part_pending; // 表示されるようにするパート。-1 なら保留なし
+    DWORD m_drag_tick;          // ドラッグ中の計測を始めた時刻
+    DWORD m_drag_layouts;       // ドラッグ中の計測を始めたときの折り返し回数
+    DWORD m_drag_layouts_per_sec; // ドラッグ中の直近1秒間の折り返し回数 (FC_GETPERFSTATS)
+    HDC m_back_dc;              // 裏画面のメモリDC
+    HBITMAP m_back_bitmap;      // 裏画面のビットマップ
+    HGDIOBJ m_back_old_bitmap;  // m_back_dc に元々選択されていたビットマップ
+    INT m_back_cx, m_back_cy;   // 裏画面の大きさ
+    INT m_back_bpp;             // 裏画面を作ったときの画面の色深度
+    RunBitmapCache m_run_cache; // 描画済みのランのキャッシュ (FC_SETRENDERCACHE)
+    DWORD m_paint_count;        // WM_PAINT を処理した回数 (FC_GETPERFSTATS)
+    uint64_t m_paint_ticks;     // WM_PAINT の累積時間 (get_perf_ticks)
+
+    enum {
+        TIMER_ID_PREFETCH = 1,          // 次のページのランを先に描いておくタイマー
+        PREFETCH_DELAY = 100,           // 描画してから先読みを始めるまでのミリ秒
+        TIMER_ID_FLUSH = 2,             // 保留した表示位置の調整を、描画がなくても行うタイマー
+        FLUSH_DELAY = USER_TIMER_MINIMUM,
+        MAX_RUN_BITMAP_WIDTH = 4096     // これより幅の広いランはキャッシュしない
+    };
 
     FuriganaCtl_impl(BaseTextBox *self) : BaseTextBox_impl(self) {
         m_sub_font = NULL;
@@ -30,11 +99,25 @@ struct FuriganaCtl_impl : BaseTextBox_impl {
         m_scroll_y = 0;
         m_scroll_step_x = 24;
         m_scroll_step_y = 24;
+        m_scroll_info_pending = false;
+        m_visible_part_pending = -1;
+        m_drag_tick = 0;
+        m_drag_layouts = 0;
+        m_drag_layouts_per_sec = 0;
+        m_back_dc = NULL;
+        m_back_bitmap = NULL;
+        m_back_old_bitmap = NULL;
+        m_back_cx = m_back_cy = 0;
+        m_back_bpp = 0;
+        m_paint_count = 0;
+        m_paint_ticks = 0;
 
         SetRect(&m_margin_rect, 2, 2, 2, 2);
         reset_colors();
+        m_doc.set_colors(m_colors);
     }
     ~FuriganaCtl_impl() {
+        discard_back_buffer();
         if (m_own_sub_font && m_sub_font) {
             ::DeleteObject(m_sub_font);
             m_sub_font = NULL;
@@ -50,7 +133,21 @@ struct FuriganaCtl_impl : BaseTextBox_impl {
     virtual INT hit_test(INT x, INT y);
     virtual void invalidate();
     virtual void update_scroll_info();
+    void request_scroll_info();
+    void flush_pending();
+    void scroll_to_part(INT iPart);
+    void scroll_client(INT old_scroll_x, INT old_scroll_y);
+    bool get_parts_client_rect(INT iStart, INT iEnd, RECT *prc);
+    void invalidate_doc_rects(const std::vector<RECT>& rects);
+    void invalidate_parts(INT iStart, INT iEnd);
+    void invalidate_selection();
+    void set_selection(INT iStart, INT iEnd);
     virtual void paint_inner(HWND hwnd, HDC dc, RECT *rect);
+    HDC ensure_back_buffer(HDC dc, INT cx, INT cy);
+    void discard_back_buffer();
+    bool paint_cached_runs(HDC dc, RECT *prc, const RECT *prcVisible, UINT flags);
+    const RunBitmap *get_run_bitmap(HDC dcCompat, INT iRun, INT layout_width, UINT flags);
+    void prefetch_runs();
     virtual void ensure_visible(INT iPart);
     virtual LRESULT notify_parent(INT code, FURIGANA_NOTIFY *notify);
     virtual HMENU load_context_menu();
@@ -75,6 +172,8 @@ struct FuriganaCtl_impl : BaseTextBox_impl {
     virtual void OnSetFocus(HWND hwnd, HWND hwndOldFocus);
     virtual void OnKillFocus(HWND hwnd, HWND hwndNewFocus);
     virtual void OnRButtonUp(HWND hwnd, int x, int y, UINT flags);
+    virtual void OnDisplayChange(HWND hwnd, UINT bitsPerPixel, UINT cxScreen, UINT cyScreen);
+    virtual void OnTimer(HWND hwnd, UINT id);
 
     virtual LRESULT OnSetRubyRatio(INT mul, INT div);
     virtual LRESULT OnSetMargin(LPRECT prc);
@@ -84,4 +183,10 @@ struct FuriganaCtl_impl : BaseTextBox_impl {
     virtual LRESULT OnGetSelText(INT cchTextMax, LPWSTR pszText);
     virtual LRESULT OnGetIdealSize(INT type, RECT *prc);
     virtual LRESULT OnGetSel(INT *piStart, INT *piEnd);
+    virtual LRESULT OnAppendText(LPCWSTR pszText);
+    virtual LRESULT OnHitTest(INT x, INT y);
+    virtual LRESULT OnGetPartPos(INT iPart, POINT *ppt);
+    virtual LRESULT OnSetRenderCache(UINT cKB);
+    virtual LRESULT OnGetPerfStats(FURIGANA_PERFSTATS *pStats);
+    virtual LRESULT OnResetPerfStats();
 };
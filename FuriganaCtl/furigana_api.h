@@ -1,5 +1,7 @@
 ﻿#pragma once
 
+#include <stddef.h> // offsetof
+
 /////////////////////////////////////////////////////////////////
 // Styles
 
@@ -24,6 +26,18 @@
 #define FC_GETSELTEXT (WM_USER + 1006)
 // FC_GETSEL - Get selection
 #define FC_GETSEL (WM_USER + 1007)
+// FC_APPENDTEXT - Append text
+#define FC_APPENDTEXT (WM_USER + 1008)
+// FC_HITTEST - Get the part index at a client point
+#define FC_HITTEST (WM_USER + 1009)
+// FC_GETPARTPOS - Get the client position of a part
+#define FC_GETPARTPOS (WM_USER + 1010)
+// FC_SETRENDERCACHE - Set the size limit of the rendered-line cache in KB (0 disables)
+#define FC_SETRENDERCACHE (WM_USER + 1011)
+// FC_GETPERFSTATS - Get performance counters (lParam: FURIGANA_PERFSTATS * with cbSize set)
+#define FC_GETPERFSTATS (WM_USER + 1012)
+// FC_RESETPERFSTATS - Reset performance counters to zero
+#define FC_RESETPERFSTATS (WM_USER + 1013)
 
 /////////////////////////////////////////////////////////////////
 // Notification
@@ -49,6 +63,36 @@
     } FURIGANA_NOTIFY;
 #endif
 
+// FURIGANA_PERFSTATS - Counters and cumulative times for FC_GETPERFSTATS.
+// Set cbSize to the size of the structure you know; new fields are only appended.
+typedef struct tagFURIGANA_PERFSTATS {
+    UINT cbSize;
+    UINT parse_calls;       // Text parses (one per changed range)
+    UINT parts_parsed;      // Parts produced by parsing
+    UINT measure_calls;     // Measuring passes over unmeasured parts
+    UINT measurer_calls;    // Calls into the measurer (GDI text extent calls)
+    UINT update_runs_calls; // Line wrapping passes
+    UINT runs_produced;     // Runs (lines) produced by wrapping
+    UINT paint_count;       // WM_PAINT handled
+    UINT draw_calls;        // Document draws (screen and cached lines)
+    UINT parts_drawn;       // Parts in the drawn runs
+    UINT text_out_calls;    // ExtTextOutW calls
+    UINT fill_rect_calls;   // FillRect calls
+    UINT gdi_calls;         // All GDI calls made while drawing (fonts and colors included)
+    ULONGLONG parse_usec;   // Cumulative times in microseconds
+    ULONGLONG measure_usec;
+    ULONGLONG wrap_usec;    // Excludes measuring
+    ULONGLONG draw_usec;
+    ULONGLONG paint_usec;   // Whole WM_PAINT, including layout and draws
+    // Appended after the first version (FURIGANA_PERFSTATS_V1_SIZE)
+    UINT layout_count;          // Layouts (line wrapping) done by the document
+    UINT drag_layouts_per_sec;  // Layouts per second over the last full second of a mouse drag
+} FURIGANA_PERFSTATS;
+
+// Size of the first version (up to paint_usec). Fixed even when fields are appended later.
+#define FURIGANA_PERFSTATS_V1_SIZE \
+    (offsetof(FURIGANA_PERFSTATS, paint_usec) + sizeof(ULONGLONG))
+
 /////////////////////////////////////////////////////////////////
 // Functions
 
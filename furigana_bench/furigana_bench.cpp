@@ -0,0 +1,810 @@
+﻿// furigana_bench.cpp --- furigana_core のベンチマーク
+// Author: katahiromz
+// License: MIT
+//////////////////////////////////////////////////////////////////////////////
+// 合成したコーパスで解析、計測、折り返し、当たり判定、選択テキストの取得を計測し、
+// 結果を JSON または CSV で出力する。計測は FixedTextMeasurer で行うので、
+// 結果はフォントや画面に依存せず、GDIのない環境でも動く。
+// Windows では --paint で GdiTextDoc の1フレームの描画も計測する。
+//
+// 使い方: furigana_bench [--format json|csv] [--scale N] [--min-time SEC]
+//                        [--corpus NAME] [--seed N] [--output FILE] [--trace FILE]
+//                        [--paint]
+
+#include "furigana_core.h"
+#include "furigana_trace.h"
+#ifdef _WIN32
+    #include "furigana_gdi.h"
+#endif
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////////
+// タイマーと乱数
+
+// 単調増加する時刻（秒）
+static double get_seconds() {
+    return (double)get_perf_ticks() / (double)get_perf_frequency();
+}
+
+// 再現可能な乱数（線形合同法）
+struct BenchRandom {
+    uint32_t m_state;
+
+    BenchRandom(uint32_t seed) : m_state(seed) { }
+
+    // [0, n) の整数
+    INT next(INT n) {
+        m_state = m_state * 1664525 + 1013904223;
+        return (INT)((m_state >> 8) % (uint32_t)n);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// コーパス
+
+static const wchar_t *s_kanji_words[][2] = {
+    { L"漢字", L"かんじ" }, { L"振仮名", L"ふりがな" }, { L"日本語", L"にほんご" },
+    { L"表示", L"ひょうじ" }, { L"文章", L"ぶんしょう" }, { L"読書", L"どくしょ" },
+    { L"東京", L"とうきょう" }, { L"電車", L"でんしゃ" }, { L"天気", L"てんき" },
+    { L"学校", L"がっこう" }, { L"先生", L"せんせい" }, { L"昨日", L"きのう" },
+};
+static const wchar_t *s_kana_words[] = {
+    L"これは", L"それが", L"あるいは", L"ところで", L"しかし", L"です", L"ます",
+    L"テスト", L"コントロール", L"ルビ", L"ひらがな", L"カタカナ", L"と", L"の", L"を",
+};
+static const wchar_t *s_ascii_words[] = {
+    L"the", L"quick", L"brown", L"fox", L"jumps", L"over", L"lazy", L"dog",
+    L"ruby", L"text", L"control", L"layout", L"performance", L"window", L"a", L"of",
+};
+
+#define BENCH_COUNTOF(array) (sizeof(array) / sizeof((array)[0]))
+
+// ルビの多い日本語
+static std::wstring make_ruby_dense(BenchRandom& rnd, size_t size, bool newlines) {
+    std::wstring text;
+    while (text.size() < size) {
+        INT i = rnd.next(BENCH_COUNTOF(s_kanji_words));
+        if (rnd.next(2)) {
+            text += L'{';
+            text += s_kanji_words[i][0];
+            text += L'(';
+            text += s_kanji_words[i][1];
+            text += L")}";
+        } else {
+            text += s_kanji_words[i][0];
+            text += L'(';
+            text += s_kanji_words[i][1];
+            text += L')';
+        }
+        text += s_kana_words[rnd.next(BENCH_COUNTOF(s_kana_words))];
+        if (rnd.next(4) == 0)
+            text += L"、";
+        if (rnd.next(8) == 0)
+            text += L"。";
+        if (newlines && rnd.next(24) == 0)
+            text += L'\n';
+    }
+    return text;
+}
+
+// ルビのない仮名
+static std::wstring make_plain_kana(BenchRandom& rnd, size_t size) {
+    std::wstring text;
+    while (text.size() < size) {
+        text += s_kana_words[rnd.next(BENCH_COUNTOF(s_kana_words))];
+        if (rnd.next(6) == 0)
+            text += L"。";
+        if (rnd.next(40) == 0)
+            text += L'\n';
+    }
+    return text;
+}
+
+// 英文
+static std::wstring make_ascii_prose(BenchRandom& rnd, size_t size) {
+    std::wstring text;
+    while (text.size() < size) {
+        text += s_ascii_words[rnd.next(BENCH_COUNTOF(s_ascii_words))];
+        switch (rnd.next(12)) {
+        case 0: text += L". "; break;
+        case 1: text += L", "; break;
+        case 2: if (rnd.next(4) == 0) { text += L".\n"; break; } // FALL THROUGH
+        default: text += L' '; break;
+        }
+    }
+    return text;
+}
+
+// 短い行がたくさん
+static std::wstring make_short_lines(BenchRandom& rnd, size_t size) {
+    std::wstring text;
+    while (text.size() < size) {
+        INT count = 1 + rnd.next(3);
+        for (INT i = 0; i < count; ++i)
+            text += s_kana_words[rnd.next(BENCH_COUNTOF(s_kana_words))];
+        text += L'\n';
+    }
+    return text;
+}
+
+// 対応しない括弧だらけ
+static std::wstring make_pathological(BenchRandom& rnd, size_t size) {
+    static const wchar_t chars[] = L"{{(()}漢字かなab ";
+    std::wstring text;
+    while (text.size() < size)
+        text += chars[rnd.next(BENCH_COUNTOF(chars) - 1)];
+    return text;
+}
+
+// 解析の計算量の検査用。閉じない { と ( ばかりの長い段落
+static std::wstring make_adversarial(BenchRandom& rnd, size_t size) {
+    static const wchar_t chars[] = L"{{{{((((漢字か)}";
+    std::wstring text;
+    text.reserve(size);
+    while (text.size() < size) {
+        if (rnd.next(4096) == 0)
+            text += L'\n';
+        else
+            text += chars[rnd.next(BENCH_COUNTOF(chars) - 1)];
+    }
+    return text;
+}
+
+struct BenchCorpus {
+    const char *m_name;
+    std::wstring m_text;
+    double m_budget; // set_text と append_text の1回あたりの制限時間（秒）。0 なら制限なし
+};
+
+// adversarial_1mb の大きさと制限時間。線形時間の解析なら数十ミリ秒で終わる。
+#define ADVERSARIAL_SIZE (1024 * 1024)
+#define ADVERSARIAL_BUDGET 1.0
+
+// million_parts のパートの数（仮名はほぼ1文字1パート）
+#define MILLION_PARTS_SIZE (1024 * 1024)
+
+// append_text で一度に追加する文字数
+#define APPEND_CHUNK 65536
+
+static void make_corpora(std::vector<BenchCorpus>& corpora, uint32_t seed, size_t size) {
+    BenchRandom rnd(seed);
+    BenchCorpus corpus;
+    corpus.m_budget = 0;
+
+    corpus.m_name = "ruby_dense";
+    corpus.m_text = make_ruby_dense(rnd, size, true);
+    corpora.push_back(corpus);
+
+    corpus.m_name = "plain_kana";
+    corpus.m_text = make_plain_kana(rnd, size);
+    corpora.push_back(corpus);
+
+    corpus.m_name = "ascii_prose";
+    corpus.m_text = make_ascii_prose(rnd, size);
+    corpora.push_back(corpus);
+
+    corpus.m_name = "long_paragraph";
+    corpus.m_text = make_ruby_dense(rnd, size, false);
+    corpora.push_back(corpus);
+
+    corpus.m_name = "short_lines";
+    corpus.m_text = make_short_lines(rnd, size);
+    corpora.push_back(corpus);
+
+    corpus.m_name = "pathological";
+    corpus.m_text = make_pathological(rnd, size);
+    corpora.push_back(corpus);
+
+    // 大きさは --scale によらない
+    corpus.m_name = "million_parts";
+    corpus.m_text = make_plain_kana(rnd, MILLION_PARTS_SIZE);
+    corpora.push_back(corpus);
+
+    corpus.m_name = "adversarial_1mb";
+    corpus.m_text = make_adversarial(rnd, ADVERSARIAL_SIZE);
+    corpus.m_budget = ADVERSARIAL_BUDGET;
+    corpora.push_back(corpus);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 計測と出力
+
+struct BenchResult {
+    std::string m_corpus;
+    std::string m_bench;
+    INT m_param;        // 折り返し幅など。なければ 0
+    size_t m_chars;     // コーパスの文字数
+    INT m_parts;        // パートの数
+    INT m_runs;         // ランの数
+    long m_iterations;  // 繰り返した回数。時間を計らない行では 0
+    double m_seconds;   // 合計時間
+    double m_value;     // 時間以外の測定値（m_unit の単位）
+    double m_baseline;  // 比べるための以前の方法での値（m_unit の単位）。なければ 0
+    const char *m_unit; // m_value の単位。なければ ""
+};
+
+// 繰り返して計測する操作
+struct BenchOp {
+    virtual ~BenchOp() { }
+    virtual void run(long i) = 0;
+};
+
+// min_time 秒以上になるまで、回数を倍にしながら繰り返す（min_time が 0 でも1回は行う）
+static void time_op(BenchOp& op, double min_time, long& iterations, double& seconds) {
+    iterations = 0;
+    seconds = 0;
+    long batch = 1;
+    do {
+        double start = get_seconds();
+        for (long i = 0; i < batch; ++i)
+            op.run(iterations + i);
+        seconds += get_seconds() - start;
+        iterations += batch;
+        if (batch < 0x10000000)
+            batch *= 2;
+    } while (seconds < min_time);
+}
+
+// set_text: 空の文書への解析
+struct SetTextOp : BenchOp {
+    TextDoc& m_doc;
+    const std::wstring& m_text;
+    SetTextOp(TextDoc& doc, const std::wstring& text) : m_doc(doc), m_text(text) { }
+    virtual void run(long) {
+        m_doc.clear();
+        m_doc.set_text(m_text, 0);
+    }
+};
+
+// append_text: 空の文書に APPEND_CHUNK 文字ずつ追加する
+struct AppendTextOp : BenchOp {
+    TextDoc& m_doc;
+    const std::wstring& m_text;
+    AppendTextOp(TextDoc& doc, const std::wstring& text) : m_doc(doc), m_text(text) { }
+    virtual void run(long) {
+        m_doc.clear();
+        for (size_t ich = 0; ich < m_text.size(); ich += APPEND_CHUNK)
+            m_doc.append_text(m_text.substr(ich, APPEND_CHUNK), 0);
+    }
+};
+
+// set_text_edit: 折り返し済みの文書で中ほどの1文字だけを変え、変わった段落だけを解析し直して折り返す
+struct SetTextEditOp : BenchOp {
+    TextDoc& m_doc;
+    INT m_width;
+    std::wstring m_texts[2];
+    SetTextEditOp(TextDoc& doc, const std::wstring& text, INT width) : m_doc(doc), m_width(width) {
+        m_texts[0] = m_texts[1] = text;
+        if (!text.empty())
+            m_texts[1][text.size() / 2] = L'X';
+        // 折り返し済みでなければ、set_text は段落のランを残す経路を通らない
+        m_doc.set_text(m_texts[0], 0);
+        m_doc.prepare_layout(m_width, 0);
+    }
+    virtual void run(long i) {
+        m_doc.set_text(m_texts[(i + 1) & 1], 0);
+        m_doc.prepare_layout(m_width, 0);
+    }
+};
+
+// measure_wrap: すべてを計測し直して折り返す
+struct MeasureWrapOp : BenchOp {
+    TextDoc& m_doc;
+    TextMeasurer *m_measurer;
+    INT m_width;
+    MeasureWrapOp(TextDoc& doc, TextMeasurer *measurer, INT width)
+        : m_doc(doc), m_measurer(measurer), m_width(width) { }
+    virtual void run(long) {
+        m_doc.set_measurer(m_measurer);
+        m_doc.prepare_layout(m_width, 0);
+    }
+};
+
+// update_runs: 計測済みの文書の折り返し
+struct UpdateRunsOp : BenchOp {
+    TextDoc& m_doc;
+    UpdateRunsOp(TextDoc& doc) : m_doc(doc) { }
+    virtual void run(long) {
+        m_doc.update_runs(0);
+    }
+};
+
+// hit_test: ランダムな位置の当たり判定
+struct HitTestOp : BenchOp {
+    TextDoc& m_doc;
+    std::vector<POINT> m_points;
+    HitTestOp(TextDoc& doc, BenchRandom& rnd, INT width, INT height) : m_doc(doc) {
+        m_points.resize(1024);
+        for (size_t i = 0; i < m_points.size(); ++i) {
+            m_points[i].x = rnd.next(width + 1);
+            m_points[i].y = rnd.next(height + 1);
+        }
+    }
+    virtual void run(long i) {
+        const POINT& pt = m_points[i & 1023];
+        m_doc.hit_test(pt.x, pt.y, 0);
+    }
+};
+
+// get_part_position: ランダムなパートの位置
+struct PartPositionOp : BenchOp {
+    TextDoc& m_doc;
+    INT m_width;
+    std::vector<INT> m_parts;
+    PartPositionOp(TextDoc& doc, BenchRandom& rnd, INT width) : m_doc(doc), m_width(width) {
+        m_parts.resize(1024);
+        for (size_t i = 0; i < m_parts.size(); ++i)
+            m_parts[i] = rnd.next(doc.get_part_count() + 1);
+    }
+    virtual void run(long i) {
+        POINT pt;
+        m_doc.get_part_position(m_parts[i & 1023], m_width, &pt, 0);
+    }
+};
+
+// get_selection_text: すべてを選択したときの選択テキスト
+struct SelectionTextOp : BenchOp {
+    TextDoc& m_doc;
+    INT m_type;
+    SelectionTextOp(TextDoc& doc, INT type) : m_doc(doc), m_type(type) { }
+    virtual void run(long) {
+        m_doc.get_selection_text(m_type);
+    }
+};
+
+static BenchResult& add_result(
+    std::vector<BenchResult>& results,
+    const BenchCorpus& corpus,
+    const char *bench,
+    INT param,
+    const TextDoc& doc,
+    BenchOp& op,
+    double min_time)
+{
+    BenchResult result;
+    result.m_corpus = corpus.m_name;
+    result.m_bench = bench;
+    result.m_param = param;
+    result.m_chars = corpus.m_text.size();
+    result.m_value = 0;
+    result.m_baseline = 0;
+    result.m_unit = "";
+    time_op(op, min_time, result.m_iterations, result.m_seconds);
+    result.m_parts = const_cast<TextDoc&>(doc).get_part_count();
+    result.m_runs = (INT)doc.m_runs.size();
+    results.push_back(result);
+    std::fprintf(stderr, "%s/%s/%d: %.0f ns\n", corpus.m_name, bench, param,
+                 result.m_seconds * 1e9 / result.m_iterations);
+    return results.back();
+}
+
+// 時間を計らない測定値の行を追加する。baseline は以前の方法での値（なければ 0）
+static void add_value_result(
+    std::vector<BenchResult>& results,
+    const BenchCorpus& corpus,
+    const char *bench,
+    INT param,
+    const TextDoc& doc,
+    double value,
+    const char *unit,
+    double baseline = 0)
+{
+    BenchResult result;
+    result.m_corpus = corpus.m_name;
+    result.m_bench = bench;
+    result.m_param = param;
+    result.m_chars = corpus.m_text.size();
+    result.m_parts = const_cast<TextDoc&>(doc).get_part_count();
+    result.m_runs = (INT)doc.m_runs.size();
+    result.m_iterations = 0;
+    result.m_seconds = 0;
+    result.m_value = value;
+    result.m_baseline = baseline;
+    result.m_unit = unit;
+    results.push_back(result);
+    if (baseline)
+        std::fprintf(stderr, "%s/%s/%d: %.2f %s (baseline %.2f)\n", corpus.m_name, bench, param, value, unit, baseline);
+    else
+        std::fprintf(stderr, "%s/%s/%d: %.2f %s\n", corpus.m_name, bench, param, value, unit);
+}
+
+// パート、ラン、段落の配列が確保しているバイト数（テキスト本体と文字送り幅キャッシュを除く）
+static size_t get_layout_bytes(const TextDoc& doc) {
+    return doc.m_parts.capacity() * sizeof(TextPart) +
+           doc.m_part_widths.capacity() * sizeof(int32_t) +
+           doc.m_part_flags.capacity() * sizeof(uint8_t) +
+           doc.m_part_x.capacity() * sizeof(int32_t) +
+           doc.m_runs.capacity() * sizeof(TextRun) +
+           doc.m_paras.capacity() * sizeof(TextPara);
+}
+
+// パートごとにテキストを std::wstring で持っていたときに、それが余計に使ったバイト数の見積もり。
+// 文字列オブジェクトの大きさと、短い文字列の最適化に収まらない文字列のヒープ（アロケータの管理領域を除く）。
+static size_t get_part_string_bytes(const TextDoc& doc) {
+    const size_t sso_capacity = std::wstring().capacity();
+    size_t bytes = doc.m_parts.capacity() * sizeof(std::wstring);
+    for (size_t i = 0; i < doc.m_parts.size(); ++i) {
+        size_t len = doc.m_parts[i].m_end_index - doc.m_parts[i].m_start_index;
+        if (len > sso_capacity)
+            bytes += (len + 1) * sizeof(wchar_t);
+    }
+    return bytes;
+}
+
+// 折り返しの行に、1秒あたりに処理したパートの数を加える
+static void set_parts_per_sec(BenchResult& result) {
+    if (result.m_seconds > 0) {
+        result.m_value = (double)result.m_parts * result.m_iterations / result.m_seconds;
+        result.m_unit = "parts_per_sec";
+    }
+}
+
+// 1回あたりのナノ秒。時間を計らない行では 0
+static double get_ns_per_op(const BenchResult& r) {
+    return r.m_iterations ? r.m_seconds * 1e9 / r.m_iterations : 0;
+}
+
+// 制限時間のあるコーパスで、1回あたりの時間が制限を超えていないか調べる
+static bool check_budget(const BenchCorpus& corpus, const BenchResult& result) {
+    if (!corpus.m_budget)
+        return true;
+    double seconds = result.m_seconds / result.m_iterations;
+    if (seconds <= corpus.m_budget)
+        return true;
+    std::fprintf(stderr, "%s/%s: %.3f s exceeds the budget of %.3f s\n",
+                 corpus.m_name, result.m_bench.c_str(), seconds, corpus.m_budget);
+    return false;
+}
+
+// 1つのコーパスのベンチマークをすべて行う。制限時間を超えたら false を返す。
+static bool run_corpus(std::vector<BenchResult>& results, const BenchCorpus& corpus, uint32_t seed, double min_time) {
+    static const INT widths[] = { 160, 480, 1280 };
+    const INT wide_width = widths[BENCH_COUNTOF(widths) - 1];
+
+    FixedTextMeasurer measurer;
+    TextDoc doc;
+    doc.set_measurer(&measurer);
+    BenchRandom rnd(seed);
+    bool ok = true;
+
+    {
+        SetTextOp op(doc, corpus.m_text);
+        ok &= check_budget(corpus, add_result(results, corpus, "set_text", 0, doc, op, min_time));
+    }
+    {
+        AppendTextOp op(doc, corpus.m_text);
+        ok &= check_budget(corpus, add_result(results, corpus, "append_text", APPEND_CHUNK, doc, op, min_time));
+    }
+    {
+        SetTextEditOp op(doc, corpus.m_text, wide_width);
+        add_result(results, corpus, "set_text_edit", wide_width, doc, op, min_time);
+    }
+    doc.clear();
+    doc.set_text(corpus.m_text, 0);
+    {
+        MeasureWrapOp op(doc, &measurer, wide_width);
+        set_parts_per_sec(add_result(results, corpus, "measure_wrap", wide_width, doc, op, min_time));
+    }
+    for (size_t i = 0; i < BENCH_COUNTOF(widths); ++i) {
+        doc.prepare_layout(widths[i], 0);
+        UpdateRunsOp op(doc);
+        set_parts_per_sec(add_result(results, corpus, "update_runs", widths[i], doc, op, min_time));
+    }
+
+    // 解析と折り返しの結果が使うメモリ（ソースの1文字あたり）
+    doc.clear();
+    doc.set_text(corpus.m_text, 0);
+    doc.prepare_layout(wide_width, 0);
+    if (!corpus.m_text.empty()) {
+        const size_t layout_bytes = get_layout_bytes(doc);
+        add_value_result(results, corpus, "memory", wide_width, doc,
+                         (double)layout_bytes / corpus.m_text.size(), "bytes_per_char",
+                         (double)(layout_bytes + get_part_string_bytes(doc)) / corpus.m_text.size());
+    }
+
+    RECT rc = { 0, 0, wide_width, 0 };
+    doc.get_ideal_size(&rc, 0);
+    {
+        HitTestOp op(doc, rnd, wide_width, rc.bottom);
+        add_result(results, corpus, "hit_test", wide_width, doc, op, min_time);
+    }
+    {
+        PartPositionOp op(doc, rnd, wide_width);
+        add_result(results, corpus, "get_part_position", wide_width, doc, op, min_time);
+    }
+
+    doc.set_selection(0, -1);
+    for (INT type = 0; type <= 1; ++type) {
+        SelectionTextOp op(doc, type);
+        add_result(results, corpus, type ? "get_selection_text_ruby" : "get_selection_text", 0, doc, op, min_time);
+    }
+    return ok;
+}
+
+#ifdef _WIN32
+
+// 描画するページの大きさ
+#define PAINT_CX 1280
+#define PAINT_CY 800
+
+// paint: 1ページ分の描画と画面への転送。ページは1フレームごとに下へずらす。
+// 裏画面を使い回さないときは、以前の OnPaint と同じく毎フレーム作って捨てる。
+struct PaintOp : BenchOp {
+    GdiTextDoc& m_doc;
+    HDC m_target_dc;       // 画面の代わりの転送先
+    HDC m_back_dc;         // 使い回す裏画面。NULL なら毎フレーム作る
+    HBITMAP m_back_bitmap;
+    HGDIOBJ m_back_old_bitmap;
+    INT m_doc_height;
+    INT m_pages;
+
+    PaintOp(GdiTextDoc& doc, HDC target_dc, bool cached) : m_doc(doc), m_target_dc(target_dc) {
+        m_back_dc = NULL;
+        m_back_bitmap = NULL;
+        m_back_old_bitmap = NULL;
+        if (cached) {
+            m_back_dc = ::CreateCompatibleDC(m_target_dc);
+            m_back_bitmap = ::CreateCompatibleBitmap(m_target_dc, PAINT_CX, PAINT_CY);
+            m_back_old_bitmap = ::SelectObject(m_back_dc, m_back_bitmap);
+        }
+        RECT rc = { 0, 0, PAINT_CX, 0 };
+        m_doc.get_ideal_size(&rc, 0);
+        m_doc_height = rc.bottom - rc.top;
+        m_pages = (m_doc_height >= PAINT_CY) ? m_doc_height / PAINT_CY : 1;
+    }
+    virtual ~PaintOp() {
+        if (m_back_dc) {
+            ::SelectObject(m_back_dc, m_back_old_bitmap);
+            ::DeleteObject(m_back_bitmap);
+            ::DeleteDC(m_back_dc);
+        }
+    }
+    virtual void run(long i) {
+        HDC dc = m_back_dc;
+        HBITMAP hbm = NULL;
+        HGDIOBJ hbmOld = NULL;
+        if (!dc) {
+            dc = ::CreateCompatibleDC(m_target_dc);
+            hbm = ::CreateCompatibleBitmap(m_target_dc, PAINT_CX, PAINT_CY);
+            hbmOld = ::SelectObject(dc, hbm);
+        }
+
+        RECT rcPage = { 0, 0, PAINT_CX, PAINT_CY };
+        ::FillRect(dc, &rcPage, m_doc.get_back_brush());
+        INT top = -(INT)(i % m_pages) * PAINT_CY;
+        RECT rcDoc = { 0, top, PAINT_CX, top + m_doc_height };
+        m_doc.draw_doc(dc, &rcDoc, 0, NULL, &rcPage);
+        ::BitBlt(m_target_dc, 0, 0, PAINT_CX, PAINT_CY, dc, 0, 0, SRCCOPY);
+
+        if (hbm) {
+            ::SelectObject(dc, hbmOld);
+            ::DeleteObject(hbm);
+            ::DeleteDC(dc);
+        }
+        ::GdiFlush(); // 溜まったGDIの処理をフレームの時間に含める
+    }
+};
+
+// パートごとに描いていたときに、1つのパートにかかったGDI関数の数。
+// 背景は SetTextColor と FillRect、テキストは前後の SelectObject と ExtTextOutW、
+// ルビはさらに SelectObject と SetTextCharacterExtra を2回ずつと ExtTextOutW。
+static INT get_unbatched_gdi_calls(const TextDoc& doc, INT iPart) {
+    switch (doc.get_part_type(iPart)) {
+    case TextPart::NORMAL:
+        return doc.m_parts[iPart].m_base_len ? 2 + 3 : 2;
+    case TextPart::RUBY:
+        return 2 + 3 + 5;
+    default:
+        return 2;
+    }
+}
+
+// PaintOp が frames 回描いたページを、パートごとに描いていたときのGDI関数の呼び出し回数
+static double get_unbatched_gdi_calls(const PaintOp& op, long frames) {
+    const TextDoc& doc = op.m_doc;
+    const INT cRuns = (INT)doc.m_runs.size();
+    std::vector<double> page_calls(op.m_pages, 0);
+    for (INT page = 0; page < op.m_pages; ++page) {
+        // draw_doc と同じく、下端にかかっているランまで
+        INT top = page * PAINT_CY;
+        INT iFirstRun = doc.find_run_by_y(top);
+        INT iLastRun = doc.find_run_by_y(top + PAINT_CY);
+        if (iLastRun < cRuns && doc.m_runs[iLastRun].m_top < top + PAINT_CY)
+            ++iLastRun;
+        for (INT iRun = iFirstRun; iRun < iLastRun; ++iRun) {
+            const TextRun& run = doc.m_runs[iRun];
+            for (INT iPart = run.m_part_index_start; iPart < run.m_part_index_end; ++iPart)
+                page_calls[page] += get_unbatched_gdi_calls(doc, iPart);
+        }
+    }
+
+    double calls = 0;
+    for (long i = 0; i < frames; ++i)
+        calls += page_calls[i % op.m_pages];
+    return calls;
+}
+
+// 1つのコーパスの描画を、裏画面を毎フレーム作る場合と使い回す場合とで計測する
+static void run_paint(std::vector<BenchResult>& results, const BenchCorpus& corpus, double min_time) {
+    GdiTextDoc doc;
+    doc.set_text(corpus.m_text, 0);
+    doc.prepare_layout(PAINT_CX, 0);
+
+    // 転送先は画面と同じ形式のメモリDC
+    HDC screen_dc = ::GetDC(NULL);
+    HDC target_dc = ::CreateCompatibleDC(screen_dc);
+    HBITMAP target_bitmap = ::CreateCompatibleBitmap(screen_dc, PAINT_CX, PAINT_CY);
+    HGDIOBJ target_old_bitmap = ::SelectObject(target_dc, target_bitmap);
+    ::ReleaseDC(NULL, screen_dc);
+
+    {
+        PaintOp op(doc, target_dc, false);
+        add_result(results, corpus, "paint_uncached", PAINT_CY, doc, op, min_time);
+    }
+    {
+        PaintOp op(doc, target_dc, true);
+        doc.m_draw_stats.reset();
+        const BenchResult& result = add_result(results, corpus, "paint_cached", PAINT_CY, doc, op, min_time);
+
+        // 1フレームあたりのGDI関数の呼び出し回数と描いたパートの数。
+        // GDI関数の呼び出し回数は、パートごとに描いていたときの回数と並べる
+        const GdiDrawStats& stats = doc.m_draw_stats;
+        const double frames = (double)result.m_iterations;
+        const double unbatched_calls = get_unbatched_gdi_calls(op, result.m_iterations);
+        add_value_result(results, corpus, "paint_gdi_calls", PAINT_CY, doc,
+                         stats.m_gdi_calls / frames, "gdi_calls_per_frame", unbatched_calls / frames);
+        add_value_result(results, corpus, "paint_text_out_calls", PAINT_CY, doc,
+                         stats.m_text_out_calls / frames, "calls_per_frame");
+        add_value_result(results, corpus, "paint_parts_drawn", PAINT_CY, doc,
+                         stats.m_parts_drawn / frames, "parts_per_frame");
+    }
+
+    ::SelectObject(target_dc, target_old_bitmap);
+    ::DeleteObject(target_bitmap);
+    ::DeleteDC(target_dc);
+}
+
+#endif // def _WIN32
+
+static void write_csv(FILE *fp, const std::vector<BenchResult>& results) {
+    std::fprintf(fp, "corpus,benchmark,param,chars,parts,runs,iterations,total_ms,ns_per_op,value,baseline,unit\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        std::fprintf(fp, "%s,%s,%d,%lu,%d,%d,%ld,%.3f,%.1f,%.2f,%.2f,%s\n",
+                     r.m_corpus.c_str(), r.m_bench.c_str(), r.m_param, (unsigned long)r.m_chars,
+                     r.m_parts, r.m_runs, r.m_iterations, r.m_seconds * 1e3,
+                     get_ns_per_op(r), r.m_value, r.m_baseline, r.m_unit);
+    }
+}
+
+static void write_json(FILE *fp, const std::vector<BenchResult>& results, size_t scale, uint32_t seed) {
+    std::fprintf(fp, "{\n  \"scale\": %lu,\n  \"seed\": %lu,\n  \"measurer\": \"fixed\",\n  \"results\": [\n",
+                 (unsigned long)scale, (unsigned long)seed);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        std::fprintf(fp,
+            "    {\"corpus\": \"%s\", \"benchmark\": \"%s\", \"param\": %d, \"chars\": %lu, "
+            "\"parts\": %d, \"runs\": %d, \"iterations\": %ld, \"total_ms\": %.3f, \"ns_per_op\": %.1f, "
+            "\"value\": %.2f, \"baseline\": %.2f, \"unit\": \"%s\"}%s\n",
+            r.m_corpus.c_str(), r.m_bench.c_str(), r.m_param, (unsigned long)r.m_chars,
+            r.m_parts, r.m_runs, r.m_iterations, r.m_seconds * 1e3,
+            get_ns_per_op(r), r.m_value, r.m_baseline, r.m_unit, (i + 1 < results.size()) ? "," : "");
+    }
+    std::fprintf(fp, "  ]\n}\n");
+}
+
+static void usage() {
+    std::fprintf(stderr,
+        "Usage: furigana_bench [--format json|csv] [--scale N] [--min-time SEC]\n"
+        "                      [--corpus NAME] [--seed N] [--output FILE] [--trace FILE]\n"
+        "                      [--paint]   (Windows only: also time one painted page per frame)\n"
+        "Corpora: ruby_dense, plain_kana, ascii_prose, long_paragraph, short_lines, pathological,\n"
+        "         million_parts, adversarial_1mb (exits with 2 if parsing exceeds its time budget)\n");
+}
+
+int main(int argc, char **argv) {
+    const char *format = "json";
+    const char *corpus_name = NULL;
+    const char *output = NULL;
+    const char *trace = NULL; // FURIGANA_TRACE でビルドしたときだけ
+    bool paint = false;       // Windows だけ
+    size_t scale = 20000; // コーパスの文字数
+    double min_time = 0.2;
+    uint32_t seed = 12345;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (std::strcmp(arg, "--help") == 0 || std::strcmp(arg, "-h") == 0) {
+            usage();
+            return 0;
+        }
+        if (std::strcmp(arg, "--paint") == 0) {
+            paint = true;
+            continue;
+        }
+        if (!value) {
+            usage();
+            return 1;
+        }
+        if (std::strcmp(arg, "--format") == 0) {
+            format = value;
+        } else if (std::strcmp(arg, "--scale") == 0) {
+            scale = (size_t)std::strtoul(value, NULL, 10);
+        } else if (std::strcmp(arg, "--min-time") == 0) {
+            min_time = std::atof(value);
+        } else if (std::strcmp(arg, "--corpus") == 0) {
+            corpus_name = value;
+        } else if (std::strcmp(arg, "--seed") == 0) {
+            seed = (uint32_t)std::strtoul(value, NULL, 10);
+        } else if (std::strcmp(arg, "--output") == 0) {
+            output = value;
+        } else if (std::strcmp(arg, "--trace") == 0) {
+            trace = value;
+        } else {
+            usage();
+            return 1;
+        }
+        ++i;
+    }
+    if (std::strcmp(format, "json") != 0 && std::strcmp(format, "csv") != 0) {
+        usage();
+        return 1;
+    }
+#ifndef _WIN32
+    if (paint) {
+        std::fprintf(stderr, "--paint: needs GDI (Windows only)\n");
+        return 1;
+    }
+#endif
+#ifndef FURIGANA_TRACE
+    if (trace) {
+        std::fprintf(stderr, "--trace: built without FURIGANA_TRACE\n");
+        return 1;
+    }
+#endif
+
+    std::vector<BenchCorpus> corpora;
+    make_corpora(corpora, seed, scale);
+
+    std::vector<BenchResult> results;
+    bool found = false, within_budget = true;
+    for (size_t i = 0; i < corpora.size(); ++i) {
+        if (corpus_name && std::strcmp(corpus_name, corpora[i].m_name) != 0)
+            continue;
+        found = true;
+        within_budget &= run_corpus(results, corpora[i], seed, min_time);
+#ifdef _WIN32
+        if (paint)
+            run_paint(results, corpora[i], min_time);
+#endif
+    }
+    if (!found) {
+        usage();
+        return 1;
+    }
+
+    FILE *fp = output ? std::fopen(output, "w") : stdout;
+    if (!fp) {
+        std::perror(output);
+        return 1;
+    }
+    if (std::strcmp(format, "csv") == 0)
+        write_csv(fp, results);
+    else
+        write_json(fp, results, scale, seed);
+    if (fp != stdout)
+        std::fclose(fp);
+
+#ifdef FURIGANA_TRACE
+    if (trace && !furigana_trace_dump(trace)) {
+        std::perror(trace);
+        return 1;
+    }
+#endif
+    return within_budget ? 0 : 2;
+}
@@ -1,6 +1,5 @@
-﻿#include <windows.h>
+﻿#include "char_judge.h"
 #include <cassert>
-#include "char_judge.h"
 
 /**
  * @brief サロゲートペアを単一のUnicodeコードポイントにデコードします。
@@ -20,17 +19,11 @@ UINT decode_surrogate_pair(wchar_t highSurrogate, wchar_t lowSurrogate)
 }
 
 bool is_surrogate_pair_kanji(wchar_t high, wchar_t low) {
-    UINT code_point = decode_surrogate_pair(high, low);
-    // U+20000 .. U+3FFFF
-    return (0x20000 <= code_point && code_point <= 0x3FFFF);
+    return is_code_point_kanji_supplement(decode_surrogate_pair(high, low));
 }
 
 bool is_surrogate_pair_kana(wchar_t high, wchar_t low) {
-    UINT code_point = decode_surrogate_pair(high, low);
-    // U+1B000 .. U+1B0FF
-    UINT KANA_SUPPLEMENT_START = 0x1B000;
-    UINT KANA_SUPPLEMENT_END   = 0x1B0FF;
-    return (KANA_SUPPLEMENT_START <= code_point && code_point <= KANA_SUPPLEMENT_END);
+    return is_code_point_kana_supplement(decode_surrogate_pair(high, low));
 }
 
 size_t skip_one_real_char(const std::wstring& str, size_t& ich) {
@@ -1,5 +1,6 @@
 ﻿#pragma once
 
+#include "furigana_types.h"
 #include <string>
 
 // 補助関数
@@ -9,8 +10,18 @@ inline bool is_char_hiragana(wchar_t ch) {
 inline bool is_char_katakana(wchar_t ch) {
     return ((L'ァ' <= ch && ch <= L'ン') || ch == L'ー' || ch == L'ヴ');
 }
+// 補助面の文字は、wchar_t が32ビットなら1つの wchar_t に入る（サロゲートペアにならない）。
+// 比較は UINT で行う。16ビットの wchar_t では補助面の範囲に入らないだけ。
+inline bool is_code_point_kana_supplement(UINT code_point) {
+    // U+1B000 .. U+1B0FF
+    return (0x1B000 <= code_point && code_point <= 0x1B0FF);
+}
+inline bool is_code_point_kanji_supplement(UINT code_point) {
+    // U+20000 .. U+3FFFF
+    return (0x20000 <= code_point && code_point <= 0x3FFFF);
+}
 inline bool is_char_kana(wchar_t ch) {
-    return is_char_hiragana(ch) || is_char_katakana(ch);
+    return is_char_hiragana(ch) || is_char_katakana(ch) || is_code_point_kana_supplement((UINT)ch);
 }
 inline bool is_char_digit(wchar_t ch) {
     return ((L'0' <= ch && ch <= L'9') || (L'０' <= ch && ch <= L'９'));
@@ -28,7 +39,8 @@ inline bool is_char_alpha_numeric(wchar_t ch) {
     return is_char_alpha(ch) || is_char_digit(ch);
 }
 inline bool is_char_kanji(wchar_t ch) {
-    return ((0x3400 <= ch && ch <= 0x9FFF) || (0xF900 <= ch && ch <= 0xFAFF) || ch == 0x3005 || ch == 0x3007);
+    return ((0x3400 <= ch && ch <= 0x9FFF) || (0xF900 <= ch && ch <= 0xFAFF) || ch == 0x3005 || ch == 0x3007 ||
+            is_code_point_kanji_supplement((UINT)ch));
 }
 
 #define is_surrogate_pair(high, low) IS_SURROGATE_PAIR((high), (low))
@@ -41,3 +53,17 @@ UINT decode_surrogate_pair(wchar_t highSurrogate, wchar_t lowSurrogate);
 bool is_ascii_word_char(wchar_t ch);
 bool is_space_char(wchar_t ch);
 INT find_word_boundary(const std::wstring& text, INT index, INT count, INT action);
+
+/**
+ * 文字列の ich の位置からコードポイントを1つ読み込み、ich を進める。
+ * @param text 文字列。
+ * @param ich 読み込む位置。関数は次の位置に更新する。
+ * @param ich_end 読み込みの終端。
+ * @return コードポイント。
+ */
+inline UINT read_code_point(const std::wstring& text, size_t& ich, size_t ich_end) {
+    wchar_t ch = text[ich++];
+    if (IS_HIGH_SURROGATE(ch) && ich < ich_end && IS_LOW_SURROGATE(text[ich]))
+        return decode_surrogate_pair(ch, text[ich++]);
+    return ch;
+}
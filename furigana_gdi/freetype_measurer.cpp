@@ -0,0 +1,82 @@
+﻿// freetype_measurer.cpp
+/////////////////////////////////////////////////////////////////////////////
+
+#include "freetype_measurer.h"
+
+FreeTypeTextMeasurer::FreeTypeTextMeasurer() {
+    m_library = NULL;
+    m_faces[BASE_FONT] = m_faces[RUBY_FONT] = NULL;
+    if (FT_Init_FreeType(&m_library))
+        m_library = NULL;
+}
+
+FreeTypeTextMeasurer::~FreeTypeTextMeasurer() {
+    if (m_faces[BASE_FONT])
+        FT_Done_Face(m_faces[BASE_FONT]);
+    if (m_faces[RUBY_FONT])
+        FT_Done_Face(m_faces[RUBY_FONT]);
+    if (m_library)
+        FT_Done_FreeType(m_library);
+}
+
+/**
+ * フォントファイルを読み込む。
+ * @param font どちらのフォントか。
+ * @param file_name フォントファイルのパス。
+ * @param pixel_height 文字の高さ（ピクセル）。
+ * @param face_index フォントコレクションの中のフェイスの番号。
+ * @return 成功したか？
+ */
+bool FreeTypeTextMeasurer::load_font(Font font, const char *file_name, INT pixel_height, INT face_index) {
+    if (!m_library)
+        return false;
+
+    FT_Face face;
+    if (FT_New_Face(m_library, file_name, face_index, &face))
+        return false;
+    if (FT_Set_Pixel_Sizes(face, 0, pixel_height)) {
+        FT_Done_Face(face);
+        return false;
+    }
+
+    if (m_faces[font])
+        FT_Done_Face(m_faces[font]);
+    m_faces[font] = face;
+    return true;
+}
+
+/**
+ * 文字の送り幅を求める。フォントがなければ 0。
+ * @param font フォント。
+ * @param code_point コードポイント。
+ */
+INT FreeTypeTextMeasurer::_get_advance(Font font, UINT code_point) {
+    FT_Face face = m_faces[font];
+    if (!face)
+        return 0;
+    FT_UInt glyph_index = FT_Get_Char_Index(face, code_point);
+    if (FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT))
+        return 0;
+    return (INT)((face->glyph->advance.x + 32) >> 6); // 26.6 固定小数点から
+}
+
+void FreeTypeTextMeasurer::measure_chars(Font font, LPCWSTR chars, INT cch, INT *extents, WORD * /*glyphs*/) {
+    INT extent = 0;
+    for (INT ich = 0; ich < cch; ++ich) {
+        UINT code_point = chars[ich];
+        if (0xD800 <= code_point && code_point <= 0xDBFF && ich + 1 < cch) {
+            // サロゲートペアの幅は下位に持たせる（累積幅は文字の末尾で読む）
+            code_point = 0x10000 + ((code_point - 0xD800) << 10) + (chars[ich + 1] - 0xDC00);
+            extents[ich++] = extent;
+        }
+        extent += _get_advance(font, code_point);
+        extents[ich] = extent;
+    }
+}
+
+INT FreeTypeTextMeasurer::get_font_height(Font font) {
+    FT_Face face = m_faces[font];
+    if (!face)
+        return 0;
+    return (INT)((face->size->metrics.height + 63) >> 6);
+}
@@ -0,0 +1,28 @@
+﻿// freetype_measurer.h
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "text_measurer.h"
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+/////////////////////////////////////////////////////////////////////////////
+// FreeTypeTextMeasurer - FreeTypeで計測する（GDIのない環境でのテストやプロファイル用）
+// 文字送り幅はヒンティング済みのピクセル単位の値。グリフ番号は返さない。
+
+struct FreeTypeTextMeasurer : TextMeasurer {
+    FT_Library m_library;
+    FT_Face m_faces[2]; // ベースとルビのフェイス
+
+    FreeTypeTextMeasurer();
+    virtual ~FreeTypeTextMeasurer();
+
+    bool load_font(Font font, const char *file_name, INT pixel_height, INT face_index = 0);
+
+    virtual void measure_chars(Font font, LPCWSTR chars, INT cch, INT *extents, WORD *glyphs);
+    virtual INT get_font_height(Font font);
+
+protected:
+    INT _get_advance(Font font, UINT code_point);
+};
@@ -0,0 +1,1523 @@
+﻿// furigana_core.cpp
+/////////////////////////////////////////////////////////////////////////////
+
+#include "furigana_core.h"
+#include "char_judge.h"
+#include "furigana_trace.h"
+#include <assert.h>
+#ifndef _WIN32
+    #include <time.h>
+#endif
+
+// FIXME: 醜いコード
+#undef min
+#undef max
+#include <algorithm>
+#define min std::min
+#define max std::max
+
+// デバッグ出力（Windows のみ）
+static inline void DPRINTF(LPCWSTR fmt, ...) {
+#if !defined(NDEBUG) && defined(_WIN32)
+    WCHAR text[1024];
+    va_list va;
+    va_start(va, fmt);
+    INT len = wvsprintfW(text, fmt, va);
+    assert(len < _countof(text));
+    ::OutputDebugStringW(text);
+    va_end(va);
+#else
+    (void)fmt;
+#endif
+}
+
+/**
+ * 性能計測用の単調増加するカウンタの値を返す。
+ * Windows では QueryPerformanceCounter、それ以外では CLOCK_MONOTONIC のナノ秒。
+ */
+uint64_t get_perf_ticks() {
+#ifdef _WIN32
+    LARGE_INTEGER count;
+    ::QueryPerformanceCounter(&count);
+    return (uint64_t)count.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/**
+ * get_perf_ticks の1秒あたりのカウント数を返す。
+ */
+uint64_t get_perf_frequency() {
+#ifdef _WIN32
+    LARGE_INTEGER freq;
+    ::QueryPerformanceFrequency(&freq);
+    return (uint64_t)freq.QuadPart;
+#else
+    return 1000000000;
+#endif
+}
+
+/**
+ * 右そろえ、中央そろえのためのランのX方向のずれを求める。
+ * @param max_width 最大幅。
+ * @param run_width ランの幅。
+ * @param flags 次のフラグを使用可能: DT_LEFT, DT_CENTER, DT_RIGHT。
+ * @return X方向のずれ。
+ */
+static inline INT get_run_delta_x(INT max_width, INT run_width, UINT flags) {
+    if (flags & DT_CENTER)
+        return (max_width - run_width) / 2;
+    if (flags & DT_RIGHT)
+        return max_width - run_width;
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// 禁則処理ヘルパー（C++03対応）
+
+//#define NO_KINSOKU
+
+#ifndef NO_KINSOKU // 禁則処理をするか？
+
+static bool is_kinsoku_head(wchar_t ch) {
+    static const wchar_t head[] = L"、。，．)]｝〕〉》」』】〙〗〟’”ゝゞ々ぁぃぅぇぉっゃゅょァィゥェォッャュョヮヵヶー゛゜？！";
+    const wchar_t *pch = head;
+    while (*pch) {
+        if (*pch == ch)
+            return true;
+        ++pch;
+    }
+    return false;
+}
+
+static bool is_kinsoku_tail(wchar_t ch) {
+    static const wchar_t tail[] = L"([｛〔〈《「『【〘〖〝‘“（";
+    const wchar_t *pch = tail;
+    while (*pch) {
+        if (*pch == ch)
+            return true;
+        ++pch;
+    }
+    return false;
+}
+
+#endif // ndef NO_KINSOKU
+
+/////////////////////////////////////////////////////////////////////////////
+// TextAdvanceCache - 文字送り幅キャッシュ。
+
+/**
+ * コードポイントの文字送り幅を取得する。
+ * @param code_point コードポイント。
+ * @return 文字送り幅。未計測なら UNKNOWN、計測待ちなら PENDING。
+ */
+INT TextAdvanceCache::lookup(UINT code_point) const {
+    if (code_point < 0x10000) {
+        size_t iPage = (code_point >> 8);
+        if (iPage >= m_pages.size() || m_pages[iPage].empty())
+            return UNKNOWN;
+        return m_pages[iPage][code_point & 0xFF];
+    }
+
+    std::map<UINT, INT>::const_iterator it = m_astral.find(code_point);
+    if (it == m_astral.end())
+        return UNKNOWN;
+    return it->second;
+}
+
+/**
+ * コードポイントの文字送り幅を格納する。
+ * @param code_point コードポイント。
+ * @param width 文字送り幅または PENDING。
+ */
+void TextAdvanceCache::store(UINT code_point, INT width) {
+    if (code_point < 0x10000) {
+        size_t iPage = (code_point >> 8);
+        if (m_pages.empty())
+            m_pages.resize(0x100);
+        std::vector<INT>& page = m_pages[iPage];
+        if (page.empty())
+            page.assign(0x100, UNKNOWN);
+        page[code_point & 0xFF] = width;
+        return;
+    }
+
+    m_astral[code_point] = width;
+}
+
+/**
+ * コードポイントのグリフ番号を取得する。
+ * @param code_point コードポイント。
+ * @return グリフ番号。なければ NO_GLYPH。
+ */
+WORD TextAdvanceCache::lookup_glyph(UINT code_point) const {
+    if (code_point >= 0x10000)
+        return NO_GLYPH;
+    size_t iPage = (code_point >> 8);
+    if (iPage >= m_glyph_pages.size() || m_glyph_pages[iPage].empty())
+        return NO_GLYPH;
+    return m_glyph_pages[iPage][code_point & 0xFF];
+}
+
+/**
+ * コードポイントのグリフ番号を格納する。BMP外の文字は格納しない。
+ * @param code_point コードポイント。
+ * @param glyph グリフ番号または NO_GLYPH。
+ */
+void TextAdvanceCache::store_glyph(UINT code_point, WORD glyph) {
+    if (code_point >= 0x10000)
+        return;
+    size_t iPage = (code_point >> 8);
+    if (m_glyph_pages.empty())
+        m_glyph_pages.resize(0x100);
+    std::vector<WORD>& page = m_glyph_pages[iPage];
+    if (page.empty())
+        page.assign(0x100, (WORD)NO_GLYPH);
+    page[code_point & 0xFF] = glyph;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// TextPart - テキストのパート。
+
+/**
+ * パートの幅を計測する。文字送り幅は文書のキャッシュから求める。
+ * @param doc 文書。
+ * @param type パートの種類。
+ * @return パートの幅。
+ */
+INT TextPart::update_width(TextDoc& doc, Type type) {
+    switch (type) {
+    case TextPart::NORMAL:
+        m_base_width = doc._get_text_width(TextMeasurer::BASE_FONT, doc.m_base_advances, m_base_index, m_base_len);
+        m_ruby_width = 0;
+        return m_base_width;
+    case TextPart::RUBY:
+        m_base_width = doc._get_text_width(TextMeasurer::BASE_FONT, doc.m_base_advances, m_base_index, m_base_len);
+        m_ruby_width = doc._get_text_width(TextMeasurer::RUBY_FONT, doc.m_ruby_advances, m_ruby_index, m_ruby_len);
+        // ルビブロックの幅は、ベースとルビの幅の大きい方
+        return max(m_base_width, m_ruby_width);
+    case TextPart::NEWLINE:
+    default:
+        m_base_width = 0;
+        m_ruby_width = 0;
+        return 0;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// TextRun - テキストの連続(ラン)。
+
+/**
+ * ランの高さを計測する。
+ * @param doc 文書。
+ */
+void TextRun::update_height(TextDoc& doc) {
+    // ルビがあるか？
+    m_has_ruby = false;
+    for (INT iPart = m_part_index_start; iPart < m_part_index_end; ++iPart) {
+        assert(0 <= iPart && iPart < doc.get_part_count());
+        if (doc.m_part_flags[iPart] & TextDoc::PF_HAS_RUBY) {
+            m_has_ruby = true;
+            break;
+        }
+    }
+
+    m_base_height = doc.m_base_height;
+    if (m_has_ruby) {
+        m_ruby_height = doc.m_ruby_height;
+        m_run_height = m_ruby_height + m_base_height;
+    } else {
+        m_ruby_height = 0;
+        m_run_height = m_base_height;
+    }
+
+    if (m_run_height < m_base_height) {
+        m_run_height = m_base_height;
+    }
+}
+
+/**
+ * ランの幅を計算する。パーツは計測済みであること。
+ * @param doc 文書。
+ */
+void TextRun::update_width(TextDoc& doc) {
+    m_run_width = 0;
+    for (INT iPart = m_part_index_start; iPart < m_part_index_end; ++iPart) {
+        m_run_width += doc.m_part_widths[iPart];
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// TextDoc
+
+/**
+ * 次のレイアウトで最初から折り返させる。折り返し幅が変わったときと同じく扱う。
+ */
+void TextDoc::set_dirty() {
+    ++m_width_gen;
+    m_relayout_part = 0;
+    m_relayout_end = -1;
+}
+
+/**
+ * 折り返し幅をセットする。変わったときだけ最初から折り返させる。
+ * @param max_width 折り返し幅。
+ */
+void TextDoc::_set_max_width(INT max_width) {
+    if (m_max_width == max_width)
+        return;
+    m_max_width = max_width;
+    set_dirty();
+}
+
+/**
+ * 行間をセットする。ランの垂直位置だけを計算し直させる。
+ * @param line_gap 行間（ピクセル単位）。
+ */
+void TextDoc::set_line_gap(INT line_gap) {
+    if (m_line_gap == line_gap)
+        return;
+    m_line_gap = line_gap;
+    ++m_gap_gen;
+}
+
+/**
+ * 計測に使うものを差し替えて、計測からやり直させる。描画のフォントは変わらない。
+ * @param measurer 計測に使うもの。弱い参照。NULL なら既定の計測に戻す。
+ */
+void TextDoc::set_measurer(TextMeasurer *measurer) {
+    m_measurer = measurer ? measurer : &m_fixed_measurer;
+    _reset_measurement();
+}
+
+/**
+ * 計測の結果を捨てて、すべてのパートを計測し直させる。
+ */
+void TextDoc::_reset_measurement() {
+    // しきい値を取得する（計測と描画の両方で必要）
+    m_gap_threshold = m_measurer->get_text_width(TextMeasurer::BASE_FONT, L"漢i", 2);
+
+    // 文字送り幅はフォントごとに異なる。同じハンドル値が再利用されることもあるので常に捨てる。
+    m_base_advances.clear();
+    m_ruby_advances.clear();
+
+    // すべてのパートを再計測する
+    std::fill(m_part_widths.begin(), m_part_widths.end(), -1);
+    m_unmeasured_part = 0;
+    ++m_font_gen;
+
+    set_dirty();
+}
+
+/**
+ * キャッシュにない文字を集める。集めた文字は計測待ちとしてキャッシュに印を付ける。
+ * @param cache 文字送り幅キャッシュ。
+ * @param index m_text 内の開始インデックス。
+ * @param len 文字列の長さ。
+ * @param missing 計測待ちの文字を追加する文字列。
+ */
+void TextDoc::_collect_missing_chars(TextAdvanceCache& cache, size_t index, size_t len, std::wstring& missing) {
+    size_t ich = index, ich_end = index + len;
+    while (ich < ich_end) {
+        size_t ich0 = ich;
+        UINT code_point = read_code_point(m_text, ich, ich_end);
+        if (cache.lookup(code_point) != TextAdvanceCache::UNKNOWN)
+            continue;
+        cache.store(code_point, TextAdvanceCache::PENDING);
+        missing.append(m_text, ich0, ich - ich0);
+    }
+}
+
+/**
+ * 計測待ちの文字をまとめて計測してキャッシュに格納する。
+ * 累積幅から各文字の送り幅を求めるので、計測の呼び出しは一括で済む。
+ * 計測がグリフ番号も返せば（GDI）、描画では ETO_GLYPH_INDEX を使う。
+ * @param font フォント。
+ * @param cache 文字送り幅キャッシュ。
+ * @param missing 計測待ちの文字の並び。
+ */
+void TextDoc::_measure_missing_chars(TextMeasurer::Font font, TextAdvanceCache& cache, const std::wstring& missing) {
+    if (missing.empty())
+        return;
+
+    // 一度に渡す文字数（長すぎる文字列を避ける）
+    const size_t c_batch = 1024;
+
+    std::vector<INT> extents;
+    std::vector<WORD> glyphs;
+    size_t ich = 0;
+    while (ich < missing.size()) {
+        size_t ich_end = min(ich + c_batch, missing.size());
+        // サロゲートペアを分断しない
+        if (ich_end < missing.size() && IS_LOW_SURROGATE(missing[ich_end]))
+            ++ich_end;
+
+        size_t ich_batch = ich;
+        INT cch = (INT)(ich_end - ich_batch);
+        extents.resize(cch);
+        glyphs.assign(cch, (WORD)TextAdvanceCache::NO_GLYPH);
+        m_measurer->measure_chars(font, &missing[ich_batch], cch, &extents[0], &glyphs[0]);
+        ++m_stats.m_measurer_calls;
+
+        INT prev_extent = 0;
+        while (ich < ich_end) {
+            size_t ich0 = ich;
+            UINT code_point = read_code_point(missing, ich, ich_end);
+            INT extent = extents[ich - 1 - ich_batch]; // この文字の末尾までの累積幅
+            cache.store(code_point, extent - prev_extent);
+            cache.store_glyph(code_point, glyphs[ich0 - ich_batch]);
+            prev_extent = extent;
+        }
+    }
+}
+
+/**
+ * キャッシュを使ってテキストの幅を求める。キャッシュにない文字だけ計測する。
+ * @param font フォント。
+ * @param cache フォントの文字送り幅キャッシュ。
+ * @param index m_text 内の開始インデックス。
+ * @param len 文字列の長さ。
+ * @return テキストの幅。
+ */
+INT TextDoc::_get_text_width(TextMeasurer::Font font, TextAdvanceCache& cache, size_t index, size_t len) {
+    INT width = 0;
+    size_t ich = index, ich_end = index + len;
+    while (ich < ich_end) {
+        size_t ich0 = ich;
+        UINT code_point = read_code_point(m_text, ich, ich_end);
+        INT advance = cache.lookup(code_point);
+        if (advance < 0) {
+            std::wstring missing(m_text, ich0, ich - ich0);
+            _measure_missing_chars(font, cache, missing);
+            advance = cache.lookup(code_point);
+        }
+        width += advance;
+    }
+    return width;
+}
+
+/**
+ * パートを追加する。
+ * @param type パートの種類。
+ * @param start_index 元の compound_text 内での開始インデックス。
+ * @param end_index 元の compound_text 内での終了インデックス。
+ * @param base_index ベーステキストの開始インデックス。
+ * @param base_len ベーステキストの長さ。
+ * @param ruby_index ルビテキストの開始インデックス。
+ * @param ruby_len ルビテキストの長さ。
+ */
+void TextDoc::_add_part(
+    TextPart::Type type,
+    size_t start_index,
+    size_t end_index,
+    size_t base_index,
+    size_t base_len,
+    size_t ruby_index,
+    size_t ruby_len)
+{
+    TextPart part;
+    part.m_start_index = start_index;
+    part.m_end_index = end_index;
+    part.m_base_index = base_index;
+    part.m_base_len = base_len;
+    part.m_ruby_index = ruby_index;
+    part.m_ruby_len = ruby_len;
+    m_parts.push_back(part);
+
+    uint8_t flags = (uint8_t)type;
+    if (type == TextPart::RUBY && ruby_len > 0)
+        flags |= PF_HAS_RUBY;
+    m_part_flags.push_back(flags);
+    m_part_widths.push_back(-1); // 未計測
+    m_part_x.push_back(0);
+}
+
+/**
+ * 段落を追加する。m_text の [ich, ich_end) を前から一度だけ走査してパートに分ける。
+ * 走査した位置は戻らないので、どんな入力でも O(n) で終わる。
+ * @param ich 段落の開始インデックス。
+ * @param ich_end 段落の終了インデックス。
+ */
+void TextDoc::_add_para(size_t ich, size_t ich_end) {
+    FURIGANA_TRACE_SCOPE("TextDoc::_add_para");
+    const size_t npos = std::wstring::npos;
+
+    TextPara para;
+    para.m_part_index_start = (INT)m_parts.size();
+    para.m_start_index = ich;
+    para.m_end_index = ich_end;
+
+    // "{...(...)}" の閉じ ")}" の探索結果。
+    // close_limit より前の '{' に対しては、close_pos と last_paren をそのまま使える。
+    size_t close_scan = ich;    // 次に探索を始める位置
+    size_t close_limit = ich;   // 探索結果が有効な範囲の終わり
+    size_t close_pos = npos;    // 見つかった ")}" の位置
+    size_t last_paren = npos;   // close_pos より前の最後の '(' の位置
+
+    while (ich < ich_end) {
+        wchar_t ch = m_text[ich];
+
+        if (ch == L'{') {
+            // "{}"
+            if (ich + 1 < ich_end && m_text[ich + 1] == L'}') {
+                ich += 2;
+                continue;
+            }
+
+            // "{ベーステキスト(ルビテキスト)}"
+            if (ich >= close_limit) {
+                // まだ調べていない範囲から ")}" を探す。改行を越えない。
+                size_t pos = max(close_scan, ich);
+                close_pos = last_paren = npos;
+                for (; pos < ich_end; ++pos) {
+                    wchar_t ch2 = m_text[pos];
+                    if (ch2 == L'\n')
+                        break;
+                    if (ch2 == L'(') {
+                        last_paren = pos;
+                    } else if (ch2 == L')' && pos + 1 < ich_end && m_text[pos + 1] == L'}') {
+                        close_pos = pos;
+                        break;
+                    }
+                }
+                close_scan = close_limit = pos;
+            }
+            if (close_pos != npos && last_paren != npos && ich < last_paren) {
+                _add_part(TextPart::RUBY, ich, close_pos + 2,
+                          ich + 1, last_paren - (ich + 1),
+                          last_paren + 1, close_pos - (last_paren + 1));
+                ich = close_pos + 2;
+                continue;
+            }
+        }
+
+        // "漢字(ふりがな)"
+        size_t ich0 = ich; // 漢字の始まり
+        size_t kanji_len = skip_kanji_chars(m_text, ich);
+        if (kanji_len > 0) {
+            if (ich < ich_end && m_text[ich] == L'(') { // 漢字の次に半角の丸カッコがある？
+                size_t ich1 = ich + 1; // フリガナの始まり
+                size_t ich2 = ich1;
+                size_t kana_len = skip_kana_chars(m_text, ich2);
+                // 丸カッコの後にカナがあり、その次に「丸カッコ閉じる」がある？
+                if (kana_len > 0 && ich2 < ich_end && m_text[ich2] == L')') {
+                    _add_part(TextPart::RUBY, ich0, ich2 + 1,
+                              ich0, (ich1 - 1) - ich0,
+                              ich1, ich2 - ich1);
+                    ich = ich2 + 1;
+                    continue;
+                }
+            }
+
+            // ルビが付かない漢字は一文字ずつ。漢字の並びを調べ直さない。
+            size_t kanji_end = ich;
+            ich = ich0;
+            while (ich < kanji_end) {
+                size_t char_index = ich;
+                size_t char_len = skip_one_real_char(m_text, ich);
+                _add_part(TextPart::NORMAL, char_index, ich, char_index, char_len, 0, 0);
+            }
+            continue;
+        }
+
+        // 英単語なら、ワードラップのため、単語ごとパートにする。
+        if (is_ascii_word_char(ch)) {
+            size_t start = ich;
+            ich = find_word_boundary(m_text, (INT)ich, (INT)ich_end, +1);
+            _add_part(TextPart::NORMAL, start, ich, start, ich - start, 0, 0);
+            continue;
+        }
+
+        if (ch == L'\n') { // 改行文字を検出した場合
+            _add_part(TextPart::NEWLINE, ich, ich + 1, ich, 1, 0, 0);
+            ++ich;
+            continue;
+        }
+
+        // その他は一文字ずつ
+        size_t char_index = ich;
+        size_t char_len = skip_one_real_char(m_text, ich);
+        _add_part(TextPart::NORMAL, char_index, ich, char_index, char_len, 0, 0);
+    }
+
+    para.m_part_index_end = (INT)m_parts.size();
+    m_paras.push_back(para);
+}
+
+/**
+ * パートのインデックスから座標を求める。
+ * 返す座標は layout の起点 (0,0) に対する相対座標です（draw_doc の prc->top/left を 0 と見なしたとき）。
+ * @param iPart パートのインデックス。
+ * @param layout_width 折り返しを行う場合の幅（pixels）。DT_SINGLELINE のときは無視されます。
+ * @param ppt 座標を受け取るPOINT構造体へのポインタ。
+ * @param flags draw_doc と同じフラグ（DT_SINGLELINE, DT_CENTER, DT_RIGHT）。
+ * @return 成功すれば true、失敗すれば false。
+ */
+bool TextDoc::get_part_position(INT iPart, INT layout_width, LPPOINT ppt, UINT flags) {
+    if (!ppt) return false;
+    if (iPart < 0) iPart = 0;
+    if (iPart >= (INT)m_parts.size()) iPart = (INT)m_parts.size();
+
+    // m_max_width を設定してランを更新（m_delta_x も最新になる）
+    _set_max_width(((flags & DT_SINGLELINE) && !(flags & (DT_RIGHT | DT_CENTER))) ? MAXLONG : layout_width);
+
+    ensure_layout(flags);
+
+    if (iPart == 0) {
+        ppt->x = m_runs.empty() ? 0 : m_runs[0].m_delta_x;
+        ppt->y = 0;
+        return true;
+    }
+
+    // パートを含むランを二分探索で探す
+    INT iRun = find_run_of_part(iPart);
+    if (iRun < 0) {
+        // 文書の末尾
+        ppt->x = 0;
+        ppt->y = m_runs.empty() ? 0 : (m_runs.back().m_top + m_runs.back().m_run_height);
+        return true;
+    }
+
+    const TextRun& run = m_runs[iRun];
+    ppt->x = run.m_delta_x + (iPart < run.m_part_index_end ? m_part_x[iPart] : 0);
+    ppt->y = run.m_top;
+    return true;
+}
+
+/**
+ * パートの範囲を囲む長方形を文書の座標で取得する。部分的な再描画に使う。
+ * 範囲が複数のランにまたがるときは、それらのランの該当部分をすべて囲む。
+ * レイアウトが最新でなければ計算せずに失敗する。
+ * @param iStart 開始パートのインデックス。
+ * @param iEnd 終了パートのインデックス（含まない）。
+ * @param prc 長方形を受け取る。
+ * @return 成功したか？
+ */
+bool TextDoc::get_parts_rect(INT iStart, INT iEnd, LPRECT prc) const {
+    assert(prc);
+    std::vector<RECT> rects;
+    if (!get_parts_rects(iStart, iEnd, rects))
+        return false;
+
+    if (rects.empty())
+        return false;
+
+    *prc = rects[0];
+    for (size_t i = 1; i < rects.size(); ++i) {
+        prc->left = min(prc->left, rects[i].left);
+        prc->top = min(prc->top, rects[i].top);
+        prc->right = max(prc->right, rects[i].right);
+        prc->bottom = max(prc->bottom, rects[i].bottom);
+    }
+    return true;
+}
+
+/**
+ * パートの範囲を、ランごとの長方形として文書の座標で取得する。
+ * 複数のランにまたがる範囲でも、範囲外の部分を含まない。
+ * レイアウトが最新でなければ計算せずに失敗する。
+ * @param iStart 開始パートのインデックス。
+ * @param iEnd 終了パートのインデックス（含まない）。
+ * @param rects 長方形を追加する。
+ * @return 成功したか？ 範囲が空なら何も追加せずに true。
+ */
+bool TextDoc::get_parts_rects(INT iStart, INT iEnd, std::vector<RECT>& rects) const {
+    if (iStart < 0)
+        iStart = 0;
+    if (iEnd > get_part_count())
+        iEnd = get_part_count();
+    if (iStart >= iEnd)
+        return true;
+
+    // 折り返し、垂直位置、水平位置のどれかが古ければ使えない
+    if (_is_wrap_pending() || m_runs_gap_gen != m_gap_gen || m_runs_align_gen != m_align_gen)
+        return false;
+
+    INT iFirstRun = find_run_of_part(iStart);
+    INT iLastRun = find_run_of_part(iEnd - 1);
+    if (iFirstRun < 0 || iLastRun < 0)
+        return false;
+
+    for (INT iRun = iFirstRun; iRun <= iLastRun; ++iRun) {
+        const TextRun& run = m_runs[iRun];
+        if (run.m_part_index_start >= run.m_part_index_end)
+            continue;
+
+        // ランの中の最初と最後のパートの位置から左右を求める
+        INT iLeftPart = (iRun == iFirstRun) ? iStart : run.m_part_index_start;
+        INT iRightPart = (iRun == iLastRun) ? (iEnd - 1) : (run.m_part_index_end - 1);
+        INT left = run.m_delta_x + m_part_x[iLeftPart];
+        INT right = run.m_delta_x + m_part_x[iRightPart] + m_part_widths[iRightPart];
+        if (left >= right)
+            continue;
+
+        RECT rc = { left, run.m_top, right, run.m_top + run.m_run_height };
+        rects.push_back(rc);
+    }
+    return true;
+}
+
+/**
+ * パートを含むランを二分探索で探す。開始パートが一致する空のランは、
+ * 同じパートから始まる空でないランがなければ含むとみなす（文書末尾の空行など）。
+ * @param iPart パートのインデックス。
+ * @return ランのインデックス。見つからなければ -1。
+ */
+INT TextDoc::find_run_of_part(INT iPart) const {
+    // 開始パートが iPart 以下の最後のラン
+    INT iRun = _find_run_by_part(iPart + 1) - 1;
+    if (iRun < 0)
+        return -1;
+    const TextRun& run = m_runs[iRun];
+    if (iPart < run.m_part_index_end || run.m_part_index_start == iPart)
+        return iRun;
+    return -1;
+}
+
+/**
+ * パートの元のテキストを取得する。
+ * @param iPart パートのインデックス。
+ * @return テキスト文字列。範囲外なら空文字列。
+ */
+std::wstring TextDoc::get_part_text(INT iPart) const {
+    if (iPart < 0 || iPart >= (INT)m_parts.size())
+        return L"";
+    const TextPart& part = m_parts[iPart];
+    return m_text.substr(part.m_start_index, part.m_end_index - part.m_start_index);
+}
+
+/**
+ * パートの元のテキストの最初の文字を取得する。
+ * @param iPart パートのインデックス。
+ * @return 文字。空なら 0。
+ */
+wchar_t TextDoc::get_part_first_char(INT iPart) const {
+    const TextPart& part = m_parts[iPart];
+    if (part.m_start_index >= part.m_end_index)
+        return 0;
+    return m_text[part.m_start_index];
+}
+
+/**
+ * パートの元のテキストの最後の文字を取得する。
+ * @param iPart パートのインデックス。
+ * @return 文字。空なら 0。
+ */
+wchar_t TextDoc::get_part_last_char(INT iPart) const {
+    const TextPart& part = m_parts[iPart];
+    if (part.m_start_index >= part.m_end_index)
+        return 0;
+    return m_text[part.m_end_index - 1];
+}
+
+/**
+ * 選択位置を設定する。
+ * @param iStart パートの開始インデックス。
+ * @param iEnd パートの終了インデックス。
+ * @param changed_rects NULL でなければ、見た目が変わったパートを囲む長方形（文書の座標、ランごと）を追加する。
+ * @return 長方形が求まったか？ レイアウトが最新でなければ false。そのときは全体を描き直すこと。
+ */
+bool TextDoc::set_selection(INT iStart, INT iEnd, std::vector<RECT> *changed_rects) {
+    if (iEnd == MAXLONG)
+        iEnd = (INT)m_parts.size();
+
+    INT iOldStart = m_selection_start, iOldEnd = m_selection_end;
+    get_normalized_selection(iOldStart, iOldEnd);
+
+    m_selection_start = iStart;
+    m_selection_end = iEnd;
+
+    // フォーカスがなければ選択は描画されないので、見た目は変わらない
+    if (!changed_rects || !m_set_focus)
+        return true;
+
+    INT iNewStart = iStart, iNewEnd = iEnd;
+    get_normalized_selection(iNewStart, iNewEnd);
+
+    // 新旧の選択範囲の対称差
+    bool old_empty = (iOldStart < 0 || iOldStart >= iOldEnd);
+    bool new_empty = (iNewStart < 0 || iNewStart >= iNewEnd);
+    bool ok = true;
+    if (old_empty && new_empty)
+        return true;
+    if (old_empty) {
+        ok = get_parts_rects(iNewStart, iNewEnd, *changed_rects);
+    } else if (new_empty || iOldEnd <= iNewStart || iNewEnd <= iOldStart) { // 重ならない
+        ok = get_parts_rects(iOldStart, iOldEnd, *changed_rects);
+        if (!new_empty)
+            ok = ok && get_parts_rects(iNewStart, iNewEnd, *changed_rects);
+    } else { // 重なるなら両端の変わった部分だけ
+        ok = get_parts_rects(min(iOldStart, iNewStart), max(iOldStart, iNewStart), *changed_rects) &&
+             get_parts_rects(min(iOldEnd, iNewEnd), max(iOldEnd, iNewEnd), *changed_rects);
+    }
+    return ok;
+}
+
+/**
+ * パートの高さを取得する。
+ * @param iPart パートのインデックス。
+ */
+INT TextDoc::get_part_height(INT iPart) {
+    if (iPart < 0 || iPart >= (INT)m_parts.size())
+        return 0;
+
+    return m_base_height + ((m_part_flags[iPart] & PF_HAS_RUBY) ? m_ruby_height : 0);
+}
+
+/**
+ * 文書をクリアする。
+ */
+void TextDoc::clear() {
+    m_text.clear();
+    m_parts.clear();
+    m_part_widths.clear();
+    m_part_flags.clear();
+    m_part_x.clear();
+    m_runs.clear();
+    m_paras.clear();
+    m_unmeasured_part = 0;
+    ++m_text_gen;
+    set_dirty();
+
+    m_base_height = 0;
+    m_ruby_height = 0;
+    m_selection_start = -1;
+    m_selection_end = 0;
+    m_para_width = 0;
+}
+
+/**
+ * テキストをセットする。古いテキストと共通の先頭部分と末尾部分を段落単位で求め、
+ * 変わった段落だけを解析し直す。変わらない段落のパーツ、計測結果、ランはそのまま使う。
+ * @param text テキスト文字列。
+ * @param flags 使わない。揃えは折り返しのときに指定する。
+ */
+void TextDoc::set_text(const std::wstring& text, UINT /*flags*/) {
+    if (!m_paras.empty() && m_text == text)
+        return;
+
+    const size_t old_size = m_text.size();
+    const size_t new_size = text.size();
+
+    // 文字単位で共通の先頭部分と末尾部分の長さを求める。両者は重ならない。
+    const size_t min_size = min(old_size, new_size);
+    size_t prefix = 0;
+    while (prefix < min_size && m_text[prefix] == text[prefix])
+        ++prefix;
+    size_t suffix = 0;
+    while (suffix < min_size - prefix && m_text[old_size - 1 - suffix] == text[new_size - 1 - suffix])
+        ++suffix;
+
+    // 後ろの改行文字まで共通部分に含まれる段落は、先頭からそのまま使う
+    const INT cOldParas = (INT)m_paras.size();
+    INT iFirstPara = 0;
+    while (iFirstPara < cOldParas && m_paras[iFirstPara].m_end_index < prefix)
+        ++iFirstPara;
+
+    // 前の改行文字から共通部分に含まれる段落は、末尾からそのまま使う
+    INT iTailPara = cOldParas;
+    while (iTailPara - 1 > iFirstPara && m_paras[iTailPara - 1].m_start_index >= old_size - suffix + 1)
+        --iTailPara;
+
+    // 解析し直す範囲
+    INT iPartStart = 0;
+    size_t ich_start = 0;
+    if (iFirstPara < cOldParas) {
+        iPartStart = m_paras[iFirstPara].m_part_index_start;
+        ich_start = m_paras[iFirstPara].m_start_index;
+    }
+    INT iOldTailPart = get_part_count(); // 末尾の段落の直前の改行パート
+    size_t ich_old_end = old_size;
+    if (iTailPara < cOldParas) {
+        iOldTailPart = m_paras[iTailPara].m_part_index_start - 1;
+        ich_old_end = m_paras[iTailPara].m_start_index - 1;
+    }
+    const size_t ich_new_end = ich_old_end + new_size - old_size;
+
+    // 末尾の段落を取っておき、変わった段落を取り除く
+    std::vector<TextPart> tail_parts(m_parts.begin() + iOldTailPart, m_parts.end());
+    std::vector<int32_t> tail_widths(m_part_widths.begin() + iOldTailPart, m_part_widths.end());
+    std::vector<uint8_t> tail_flags(m_part_flags.begin() + iOldTailPart, m_part_flags.end());
+    std::vector<int32_t> tail_x(m_part_x.begin() + iOldTailPart, m_part_x.end());
+    std::vector<TextPara> tail_paras(m_paras.begin() + iTailPara, m_paras.end());
+    m_parts.resize(iPartStart);
+    m_part_widths.resize(iPartStart);
+    m_part_flags.resize(iPartStart);
+    m_part_x.resize(iPartStart);
+    m_paras.resize(iFirstPara);
+
+    m_text = text;
+    _parse_text(ich_start, ich_new_end);
+
+    // 末尾の段落を、インデックスをずらして戻す
+    const INT part_delta = get_part_count() - iOldTailPart;
+    for (size_t i = 0; i < tail_parts.size(); ++i) {
+        TextPart& part = tail_parts[i];
+        part.m_start_index = part.m_start_index + new_size - old_size;
+        part.m_end_index = part.m_end_index + new_size - old_size;
+        part.m_base_index = part.m_base_index + new_size - old_size;
+        if (part.m_ruby_len > 0)
+            part.m_ruby_index = part.m_ruby_index + new_size - old_size;
+    }
+    for (size_t i = 0; i < tail_paras.size(); ++i) {
+        TextPara& para = tail_paras[i];
+        para.m_part_index_start += part_delta;
+        para.m_part_index_end += part_delta;
+        para.m_start_index = para.m_start_index + new_size - old_size;
+        para.m_end_index = para.m_end_index + new_size - old_size;
+    }
+    m_parts.insert(m_parts.end(), tail_parts.begin(), tail_parts.end());
+    m_part_widths.insert(m_part_widths.end(), tail_widths.begin(), tail_widths.end());
+    m_part_flags.insert(m_part_flags.end(), tail_flags.begin(), tail_flags.end());
+    m_part_x.insert(m_part_x.end(), tail_x.begin(), tail_x.end());
+    m_paras.insert(m_paras.end(), tail_paras.begin(), tail_paras.end());
+
+    // パートのインデックスが変わるので選択は解除する
+    m_selection_start = -1;
+    m_selection_end = 0;
+
+    // 解析し直したパートだけを計測する。末尾の段落の幅は -1 でなければ有効。
+    m_unmeasured_part = min(m_unmeasured_part, iPartStart);
+
+    if (_is_wrap_pending()) {
+        // 前回の変更がまだ折り返されていない。まとめて最後まで折り返す。
+        m_relayout_part = min(m_relayout_part, iPartStart);
+        m_relayout_end = -1;
+        ++m_text_gen;
+        return;
+    }
+
+    // 変わった段落のランを取り除き、末尾の段落のランをずらす
+    INT iFirstRun = _find_run_by_part(iPartStart);
+    INT iTailRun = (INT)m_runs.size();
+    if (iTailPara < cOldParas)
+        iTailRun = _find_run_by_part(iOldTailPart + 1);
+    bool widest_removed = false;
+    for (INT iRun = iFirstRun; iRun < iTailRun; ++iRun) {
+        if (m_runs[iRun].m_run_width >= m_para_width)
+            widest_removed = true;
+    }
+    m_runs.erase(m_runs.begin() + iFirstRun, m_runs.begin() + iTailRun);
+    for (size_t iRun = iFirstRun; iRun < m_runs.size(); ++iRun) {
+        m_runs[iRun].m_part_index_start += part_delta;
+        m_runs[iRun].m_part_index_end += part_delta;
+    }
+    if (widest_removed) {
+        m_para_width = 0;
+        for (size_t iRun = 0; iRun < m_runs.size(); ++iRun) {
+            if (m_para_width < m_runs[iRun].m_run_width)
+                m_para_width = m_runs[iRun].m_run_width;
+        }
+    }
+
+    m_relayout_part = iPartStart;
+    m_relayout_end = -1;
+    if (iTailPara < cOldParas)
+        m_relayout_end = iOldTailPart + 1 + part_delta;
+    ++m_text_gen;
+}
+
+/**
+ * テキストを末尾に追加する。最後の段落は追加したテキストとつながるので解析し直すが、
+ * それより前の段落のパーツ、計測結果、ランはそのまま使う。
+ * @param text 追加するテキスト文字列。
+ * @param flags 使わない（set_text とそろえるため）。揃えは折り返しのときに指定する。
+ */
+void TextDoc::append_text(const std::wstring& text, UINT /*flags*/) {
+    if (text.empty())
+        return;
+
+    size_t ich = m_text.size();
+    INT iPart = get_part_count();
+    if (!m_paras.empty()) {
+        // 最後の段落を取り除く。最後の段落の後ろにパートはない。
+        const TextPara& para = m_paras.back();
+        assert(para.m_part_index_end == iPart);
+        ich = para.m_start_index;
+        iPart = para.m_part_index_start;
+        m_paras.pop_back();
+
+        m_parts.resize(iPart);
+        m_part_widths.resize(iPart);
+        m_part_flags.resize(iPart);
+        m_part_x.resize(iPart);
+    }
+
+    m_text += text;
+    _parse_text(ich, m_text.size());
+
+    // 新しいパートだけを計測する
+    m_unmeasured_part = min(m_unmeasured_part, iPart);
+
+    // 取り除いた段落の先頭から折り返しをやり直す
+    if (_is_wrap_pending())
+        m_relayout_part = min(m_relayout_part, iPart);
+    else
+        m_relayout_part = iPart;
+    m_relayout_end = -1;
+    ++m_text_gen;
+}
+
+/**
+ * m_text の [ich, ich_end) を解析して、段落とパーツを追加する。
+ * @param ich 解析を始めるインデックス。段落の先頭であること。
+ * @param ich_end 解析を終えるインデックス。段落の末尾であること。
+ */
+void TextDoc::_parse_text(size_t ich, size_t ich_end) {
+    const uint64_t start_ticks = get_perf_ticks();
+    const INT cOldParts = get_part_count();
+
+    // 改行文字で段落に分ける
+    for (;;) {
+        size_t newline = m_text.find(L'\n', ich);
+        if (newline == std::wstring::npos || newline >= ich_end) {
+            _add_para(ich, ich_end);
+            break;
+        }
+
+        // 段落を追加
+        _add_para(ich, newline);
+
+        // 段落に含まれない改行文字を追加
+        _add_part(TextPart::NEWLINE, newline, newline + 1, newline, 1, 0, 0);
+        ich = newline + 1;
+    }
+
+    ++m_stats.m_parse_calls;
+    m_stats.m_parts_parsed += get_part_count() - cOldParts;
+    m_stats.m_parse_ticks += get_perf_ticks() - start_ticks;
+}
+
+/**
+ * パーツの高さを計算する。
+ */
+void TextDoc::_update_parts_height() {
+    m_base_height = m_measurer->get_font_height(TextMeasurer::BASE_FONT); // ベーステキストのフォントの高さ
+    m_ruby_height = m_measurer->get_font_height(TextMeasurer::RUBY_FONT); // ルビテキストのフォントの高さ
+}
+
+/**
+ * パーツの幅を計算する。m_unmeasured_part 以降で m_part_widths が -1 のパートだけを計測する。
+ * 先にキャッシュにない文字をフォントごとに集めて一括で計測し、各パートの幅はキャッシュの和で求める。
+ */
+void TextDoc::_update_parts_width() {
+    FURIGANA_TRACE_SCOPE("TextDoc::_update_parts_width");
+    const uint64_t start_ticks = get_perf_ticks();
+
+    std::wstring base_missing, ruby_missing;
+    for (INT iPart = m_unmeasured_part; iPart < get_part_count(); ++iPart) {
+        if (m_part_widths[iPart] >= 0)
+            continue;
+        TextPart::Type type = get_part_type(iPart);
+        if (type == TextPart::NEWLINE)
+            continue;
+        TextPart& part = m_parts[iPart];
+        _collect_missing_chars(m_base_advances, part.m_base_index, part.m_base_len, base_missing);
+        if (type == TextPart::RUBY)
+            _collect_missing_chars(m_ruby_advances, part.m_ruby_index, part.m_ruby_len, ruby_missing);
+    }
+    _measure_missing_chars(TextMeasurer::BASE_FONT, m_base_advances, base_missing);
+    _measure_missing_chars(TextMeasurer::RUBY_FONT, m_ruby_advances, ruby_missing);
+
+    for (INT iPart = m_unmeasured_part; iPart < get_part_count(); ++iPart) {
+        if (m_part_widths[iPart] < 0)
+            m_part_widths[iPart] = m_parts[iPart].update_width(*this, get_part_type(iPart));
+    }
+    m_unmeasured_part = get_part_count();
+
+    ++m_stats.m_measure_calls;
+    m_stats.m_measure_ticks += get_perf_ticks() - start_ticks;
+}
+
+/**
+ * 計測段階。フォントかテキストが変わったときだけパーツの寸法を計算する。
+ * 折り返し幅には依存しないので、折り返しのたびに行う必要はない。
+ */
+void TextDoc::_ensure_measured() {
+    const UINT stamp = m_text_gen + m_font_gen;
+    if (m_measured_stamp == stamp)
+        return;
+
+    _update_parts_height();
+    _update_parts_width();
+    m_measured_stamp = stamp;
+}
+
+/**
+ * 段落の当たり判定。
+ * @param x X座標。
+ * @param y Y座標。
+ * @return パートのインデックス。
+ */
+INT TextDoc::hit_test(INT x, INT y, UINT flags) {
+    ensure_layout(flags);
+
+    if (m_runs.empty() || y < 0) return 0;
+
+    // 垂直方向（行間はその下のランに含める）
+    INT iRun = find_run_by_y(y);
+    if (iRun >= (INT)m_runs.size())
+        return m_runs.back().m_part_index_end;
+
+    const TextRun& run = m_runs[iRun];
+    x -= run.m_delta_x; // 右そろえ、中央そろえの修正分
+
+    // 水平方向。中央が x より右にある最初のパートを二分探索で探す。
+    INT lo = run.m_part_index_start, hi = run.m_part_index_end;
+    while (lo < hi) {
+        INT mid = lo + (hi - lo) / 2;
+        if (x < m_part_x[mid] + m_part_widths[mid] / 2)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    // 改行文字の場合は、このランの終端として扱う（改行パートはランの最後にある）
+    if (lo == run.m_part_index_end && lo > run.m_part_index_start &&
+        get_part_type(lo - 1) == TextPart::NEWLINE)
+    {
+        return lo - 1;
+    }
+    return lo;
+}
+
+/**
+ * 選択領域を表すインデックス区間を正規化する。関数は引数値を変更する。
+ * @param iStart 開始のパートインデックスまたは-1。
+ * @param iEnd 終了のパートインデックスまたは-1。
+ */
+void TextDoc::get_normalized_selection(INT& iStart, INT& iEnd) {
+    if (iStart == -1) // 選択なし
+        return;
+    if (iStart == 0 && iEnd == -1) { // すべて選択
+        iEnd = (INT)m_parts.size();
+        return;
+    }
+    // それ以外の選択
+    INT start = min(iStart, iEnd), end = max(iStart, iEnd);
+    iStart = start;
+    iEnd = end;
+    assert(iStart <= iEnd);
+    assert(iStart >= 0);
+    assert(iEnd >= 0);
+}
+
+/**
+ * 選択テキストを取得する。
+ * @return 取得したテキスト文字列。
+ */
+std::wstring TextDoc::get_selection_text(INT type) {
+    INT start = m_selection_start;
+    INT end = m_selection_end;
+    get_normalized_selection(start, end);
+    if (start == -1 || end == -1) return L"";
+
+    std::wstring text;
+
+    switch (type) {
+    case 0:
+        for (INT iPart = start; iPart < end; ++iPart) {
+            if (iPart < 0)
+                continue;
+            if (iPart >= (INT)m_parts.size())
+                break;
+            TextPart& part = m_parts[iPart];
+            text.append(m_text, part.m_base_index, part.m_base_len);
+        }
+        break;
+    case 1:
+        for (INT iPart = start; iPart < end; ++iPart) {
+            if (iPart < 0)
+                continue;
+            if (iPart >= (INT)m_parts.size())
+                break;
+            TextPart& part = m_parts[iPart];
+            text.append(m_text, part.m_base_index, part.m_base_len);
+            if (part.m_ruby_len > 0) {
+                text += L'(';
+                text.append(m_text, part.m_ruby_index, part.m_ruby_len);
+                text += L')';
+            }
+        }
+        break;
+    }
+
+    return text;
+}
+
+/**
+ * 1個以上のランを更新する。
+ * @param flags 次のフラグを使用可能: DT_LEFT, DT_CENTER, DT_RIGHT, DT_SINGLELINE。
+ * @param iPartStart 折り返しをやり直す最初のパート。段落の先頭であること。
+ *                   これより前の段落のランはそのまま使う。
+ * @param iPartEnd 折り返しをやり直す範囲の終わり。段落の先頭であること。
+ *                 これ以降の段落のランはそのまま使う。-1 なら最後まで。
+ * @return ランの個数。
+ */
+INT TextDoc::update_runs(UINT flags, INT iPartStart, INT iPartEnd) {
+    FURIGANA_TRACE_SCOPE("TextDoc::update_runs");
+    const INT cParts = get_part_count();
+    if (iPartEnd < 0 || iPartEnd > cParts)
+        iPartEnd = cParts;
+
+    ++m_layout_count;
+    const uint64_t start_ticks = get_perf_ticks();
+    const uint64_t start_measure_ticks = m_stats.m_measure_ticks;
+
+    // [iPartStart, iPartEnd) から始まるランを取り除き、その後ろのランは取っておく
+    INT iFirstRun = (iPartStart > 0) ? _find_run_by_part(iPartStart) : 0;
+    INT iTailRun = (iPartEnd < cParts) ? _find_run_by_part(iPartEnd) : (INT)m_runs.size();
+    bool widest_removed = false;
+    for (INT iRun = iFirstRun; iRun < iTailRun; ++iRun) {
+        if (m_runs[iRun].m_run_width >= m_para_width)
+            widest_removed = true;
+    }
+    std::vector<TextRun> tail_runs(m_runs.begin() + iTailRun, m_runs.end());
+    m_runs.resize(iFirstRun);
+
+    // パーツの寸法を計算する（必要なときだけ）
+    _ensure_measured();
+
+    INT iPart0 = m_runs.empty() ? 0 : m_runs.back().m_part_index_end; // 現在のランの開始パートインデックス
+    INT current_x = 0; // 現在のランの幅
+
+    // パーツを全て処理するまでループ
+    for (INT iPart = iPart0; iPart < iPartEnd; ++iPart) {
+        INT part_width = m_part_widths[iPart];
+
+        // 1. 改行文字 (TextPart::NEWLINE)
+        if (get_part_type(iPart) == TextPart::NEWLINE) {
+            TextRun run;
+            run.m_part_index_start = (INT)iPart0;
+            run.m_part_index_end = iPart + 1; // 改行文字を含めてランを確定
+            run.m_run_width = current_x;
+            run.m_max_width = m_max_width;
+            m_runs.push_back(run);
+
+            // 次パートは改行の次から開始
+            iPart0 = iPart + 1;
+            current_x = 0;
+            continue;
+        }
+
+        // 2. 折り返しが必要か？ (現在のパートを加えると最大幅を超えるか)
+        bool wrap = (m_max_width > 0 && current_x + part_width > m_max_width);
+
+        if (wrap) {
+            // A) 行頭でのオーバーフロー (current_x == 0):
+            //    このパート単独で最大幅を超えている。このパートを単独でランとし、次のパートへ進む
+            if (current_x == 0) {
+                TextRun run;
+                run.m_part_index_start = (INT)iPart0;
+                run.m_part_index_end = iPart + 1; // 超過パートを含めて確定
+                run.m_run_width = part_width;
+                run.m_max_width = m_max_width;
+                m_runs.push_back(run);
+
+                // 次の行の開始を現在のパートの次にする
+                iPart0 = iPart + 1;
+                current_x = 0;
+                continue; // for の ++iPart で次のパートに進む
+            }
+
+            // B) 行の途中での折り返し (current_x != 0):
+            //    現在のパート iPart の手前 (iPart - 1) で改行を試みる
+
+            // iPart は次行の先頭になるべきパート。
+            // iBreak は、この行の終端となるパート（exclusive）。
+            INT iBreak = iPart;
+            INT break_width = current_x;
+            bool kinsoku_applied = false;
+
+#ifndef NO_KINSOKU // 禁則処理をするか？
+            // 直前パート末尾文字 / 現パート先頭文字を取得
+            wchar_t prevCh = 0, nextCh = 0;
+            if (iPart > 0)
+                prevCh = get_part_last_char(iPart - 1);
+            nextCh = get_part_first_char(iPart);
+
+            // 現行に少なくとも1パートある (iPart - iPart0 >= 1)
+            if (iPart > iPart0) {
+                INT lastIdx = iPart - 1; // 現行ランの末尾パート
+                INT lastWidth = m_part_widths[lastIdx];
+
+                // 1) 次が行頭禁則文字なら -> 現行の末尾1パートを次行へ移す試み
+                if (is_kinsoku_head(nextCh)) {
+                    INT next_line_width = lastWidth + part_width; // 次行に入る幅 (末尾 + 現パート)
+
+                    if (next_line_width <= m_max_width) {
+                        // 禁則適用: 1つ前のパート (lastIdx) まで巻き戻し、それを次行の先頭にする
+                        iBreak = lastIdx;
+                        break_width = current_x - lastWidth; // ラン幅を1パート分減らす
+                        kinsoku_applied = true;
+                    }
+                }
+
+                // 2) 直前が行末禁則文字なら -> 同様に末尾1パートを次行へ移す試み (既に kinsoku_applied ならスキップ)
+                if (!kinsoku_applied && is_kinsoku_tail(prevCh)) {
+                    INT next_line_width = lastWidth + part_width;
+
+                    if (next_line_width <= m_max_width) {
+                        // 禁則適用: 1つ前のパート (lastIdx) まで巻き戻し、それを次行の先頭にする
+                        iBreak = lastIdx;
+                        break_width = current_x - lastWidth;
+                        kinsoku_applied = true;
+                    }
+                }
+            }
+#endif // ndef NO_KINSOKU
+
+            // 行を確定 (iPart0 から iBreak の直前まで)
+            TextRun run;
+            run.m_part_index_start = (INT)iPart0;
+            run.m_part_index_end = iBreak; // exclusive
+            run.m_run_width = break_width;
+            run.m_max_width = m_max_width;
+            m_runs.push_back(run);
+
+            if (iBreak < iPart) { // 実際に巻き戻しが発生した場合
+                // 禁則処理が適用され、行が確定した後の次行の先頭 (iBreak) が、
+                // 確定前と同じ行の先頭 (iPart0) に巻き戻され、かつ iPart0 < iPart だった場合
+                if (iBreak == run.m_part_index_start && iPart0 != iPart) {
+                    // すでにRunは確定しているため、iPart0を次の行の先頭に設定し、
+                    // iBreak を次のパート iPart に強制的に進めることで無限ループを防ぐ                
+                    
+                    // **最終的な解決策: 巻き戻したランが幅制限を超えているか再確認**
+                    INT next_run_start_part = iBreak;
+                    INT next_run_width = 0;
+                    for (INT pi = next_run_start_part; pi < iPart + 1; ++pi) { // iPart + 1 まで（現在の iPart の次まで）
+                        next_run_width += m_part_widths[pi];
+                    }
+
+                    // 禁則処理により iPart0 から iBreak までのランが確定したが、
+                    // 巻き戻されたパート（iBreak以降）が**単独で最大幅を超えている**場合
+                    // （ただし、このケースでは超えていないと仮定）。
+                    // 無限ループの状況 (Part 3とPart 4が交互に巻き戻される) を強制的に断ち切る
+                    if (kinsoku_applied) {
+                         DPRINTF(L"[KINSOKU BREAK] Force advance iPart from %d to %d\n", iPart, iBreak);
+                         // 既に確定しているので、iPartを次のパートに強制的に進める
+                         iPart = iBreak; // ループの ++iPart で iBreak+1 へ進む
+                         iPart0 = iPart;
+                         current_x = 0;
+                         continue; // 巻き戻されたパートを無視して次のパートから処理を再開
+                    }
+                }
+            }
+
+
+            // 次の行の開始位置を iBreak に設定
+            iPart0 = iBreak;
+
+            // iBreak から iPart-1 までの幅 (持ち越されたパートの幅)
+            INT carry_over_width = 0;
+            for (INT pi = iBreak; pi < iPart; ++pi) {
+                carry_over_width += m_part_widths[pi];
+            }
+            current_x = carry_over_width;
+
+            // iPart の処理を再開するため、for ループの ++iPart が走る前にインデックスを調整する。
+            iPart = iBreak - 1;
+            continue; // for の ++iPart で iBreak になり、次回のループで iBreak から処理が再開される
+        }
+
+        // 3. 通常の処理 (幅を最大幅を超えない限り加算)
+        current_x += part_width;
+    }
+
+    if (iPartEnd == cParts) {
+        // 折り返しの残りのパーツのランを追加
+        TextRun run;
+        run.m_part_index_start = (INT)iPart0;
+        run.m_part_index_end = cParts;
+        run.m_run_width = current_x;
+        run.m_max_width = m_max_width;
+        m_runs.push_back(run);
+    } else {
+        // 範囲は改行パートで終わるので、残りのパーツはない
+        assert(iPart0 == iPartEnd);
+    }
+
+    // 取っておいたランを戻す
+    const INT iTailStart = (INT)m_runs.size();
+    m_runs.insert(m_runs.end(), tail_runs.begin(), tail_runs.end());
+
+    // 残したランの中から最も広い幅を求め直す
+    if (iFirstRun == 0 || widest_removed) {
+        m_para_width = 0;
+        for (INT iRun = 0; iRun < iFirstRun; ++iRun) {
+            if (m_para_width < m_runs[iRun].m_run_width)
+                m_para_width = m_runs[iRun].m_run_width;
+        }
+    }
+
+    // 追加したランの高さと水平位置、パートのランの中での位置を計算する
+    for (INT iRun = iFirstRun; iRun < (INT)m_runs.size(); ++iRun) {
+        TextRun& run = m_runs[iRun];
+        if (iRun < iTailStart) {
+            run.update_height(*this);
+            run.m_delta_x = get_run_delta_x(m_max_width, run.m_run_width, flags);
+
+            INT current_x = 0;
+            for (INT iPart = run.m_part_index_start; iPart < run.m_part_index_end; ++iPart) {
+                m_part_x[iPart] = current_x;
+                current_x += m_part_widths[iPart];
+            }
+        }
+
+        if (m_para_width < run.m_run_width)
+            m_para_width = run.m_run_width;
+    }
+
+    // 取っておいたランも含めて垂直位置を計算する
+    _update_runs_top(iFirstRun);
+
+    ++m_stats.m_update_runs_calls;
+    m_stats.m_runs_produced += iTailStart - iFirstRun;
+    m_stats.m_wrap_ticks += (get_perf_ticks() - start_ticks) - (m_stats.m_measure_ticks - start_measure_ticks);
+
+    return (INT)m_runs.size();
+}
+
+/**
+ * ランの垂直位置 (m_top) を計算する。
+ * @param iFirstRun 計算を始めるランのインデックス。これより前のランの位置は正しいこと。
+ */
+void TextDoc::_update_runs_top(INT iFirstRun) {
+    INT current_y = 0;
+    if (iFirstRun > 0)
+        current_y = m_runs[iFirstRun - 1].m_top + m_runs[iFirstRun - 1].m_run_height;
+    for (INT iRun = iFirstRun; iRun < (INT)m_runs.size(); ++iRun) {
+        TextRun& run = m_runs[iRun];
+        if (iRun > 0)
+            current_y += m_line_gap;
+        run.m_top = current_y;
+        current_y += run.m_run_height;
+    }
+}
+
+/**
+ * 指定したパート以降から始まる最初のランを二分探索で探す。ランは開始パートの順に並んでいる。
+ * @param iPart パートのインデックス。
+ * @return ランのインデックス。該当するランがなければランの個数。
+ */
+INT TextDoc::_find_run_by_part(INT iPart) const {
+    INT lo = 0, hi = (INT)m_runs.size();
+    while (lo < hi) {
+        INT mid = lo + (hi - lo) / 2;
+        if (m_runs[mid].m_part_index_start < iPart)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * 指定したY座標の位置またはそれより下にある最初のランを二分探索で探す。
+ * @param y 文書内のY座標。
+ * @return ランのインデックス。該当するランがなければランの個数。
+ */
+INT TextDoc::find_run_by_y(INT y) const {
+    // 下端が y より大きい最初のラン
+    INT lo = 0, hi = (INT)m_runs.size();
+    while (lo < hi) {
+        INT mid = lo + (hi - lo) / 2;
+        const TextRun& run = m_runs[mid];
+        if (run.m_top + run.m_run_height <= y)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * 文書の理想的なサイズを取得する。
+ * @param prc クライアント領域のRECT構造体へのポインタ。関数はサイズを変更する。
+ * @param flags 次のフラグを使用可能: DT_LEFT, DT_CENTER, DT_RIGHT, DT_SINGLELINE。
+ */
+void TextDoc::get_ideal_size(LPRECT prc, UINT flags) {
+    assert(prc);
+
+    // 折り返し幅が変わったときだけ折り返しをやり直す
+    prepare_layout(prc->right - prc->left, flags);
+
+    // レイアウト済みの寸法を返す
+    INT doc_height = 0;
+    if (!m_runs.empty())
+        doc_height = m_runs.back().m_top + m_runs.back().m_run_height;
+    prc->right = prc->left + m_para_width;
+    prc->bottom = prc->top + doc_height;
+}
+
+/**
+ * 折り返し幅を設定して、レイアウトを最新にする。
+ * @param layout_width 折り返し幅。
+ * @param flags 次のフラグを使用可能: DT_LEFT, DT_CENTER, DT_RIGHT, DT_SINGLELINE。
+ */
+void TextDoc::prepare_layout(INT layout_width, UINT flags) {
+    _set_max_width((flags & DT_SINGLELINE) ? MAXLONG : layout_width);
+    ensure_layout(flags);
+}
+
+/**
+ * ランの中の配置に影響する入力の世代の和を返す。描画結果のキャッシュが古いか調べるのに使う。
+ * 行間はランの位置だけを変えるので含まない。選択範囲は含まない。
+ */
+UINT TextDoc::get_layout_stamp() const {
+    return m_text_gen + m_font_gen + m_width_gen + m_align_gen;
+}
+
+/**
+ * 折り返しで使う入力の世代の和を返す。
+ */
+UINT TextDoc::_get_wrap_stamp() const {
+    return m_text_gen + m_font_gen + m_width_gen;
+}
+
+/**
+ * まだ折り返されていない変更があるか？
+ */
+bool TextDoc::_is_wrap_pending() const {
+    return m_wrapped_stamp != _get_wrap_stamp();
+}
+
+/**
+ * レイアウトを最新にする。入力の世代を調べて、変わった入力に依存する段階だけを計算し直す。
+ * 揃えが変わったら水平位置だけ、行間が変わったら垂直位置だけを計算する。
+ * テキスト、フォント、折り返し幅が変わったら折り返す（必要なら計測も行う）。
+ * @param flags 次のフラグを使用可能: DT_LEFT, DT_CENTER, DT_RIGHT, DT_SINGLELINE。
+ */
+void TextDoc::ensure_layout(UINT flags) {
+    UINT align_flags = flags & (DT_CENTER | DT_RIGHT);
+    if (m_align_flags != align_flags) {
+        m_align_flags = align_flags;
+        ++m_align_gen;
+    }
+
+    if (m_runs_align_gen != m_align_gen) {
+        for (size_t iRun = 0; iRun < m_runs.size(); ++iRun) {
+            TextRun& run = m_runs[iRun];
+            run.m_delta_x = get_run_delta_x(m_max_width, run.m_run_width, flags);
+        }
+        m_runs_align_gen = m_align_gen;
+    }
+
+    if (m_runs_gap_gen != m_gap_gen) {
+        _update_runs_top(0);
+        m_runs_gap_gen = m_gap_gen;
+    }
+
+    const UINT wrap_stamp = _get_wrap_stamp();
+    if (m_wrapped_stamp != wrap_stamp) {
+        DPRINTF(L"[ensure_layout] updating runs with flags: 0x%X\n", flags);
+        update_runs(flags, m_relayout_part, m_relayout_end);
+        m_wrapped_stamp = wrap_stamp;
+        m_relayout_part = 0;
+        m_relayout_end = -1;
+        DPRINTF(L"[ensure_layout] runs count: %d\n", (INT)m_runs.size());
+    }
+}
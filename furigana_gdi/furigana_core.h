@@ -0,0 +1,297 @@
+﻿// furigana_core.h
+// 解析、計測、折り返し、当たり判定。標準ライブラリだけで使える（描画は furigana_gdi.h）。
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "furigana_types.h"
+#include <string>
+#include <vector>
+#include <map>
+#include "pstdint.h"
+#include "text_measurer.h"
+
+struct TextDoc;
+
+/////////////////////////////////////////////////////////////////////////////
+// 性能計測用の時計
+
+uint64_t get_perf_ticks();     // 単調増加するカウンタの値
+uint64_t get_perf_frequency(); // get_perf_ticks の1秒あたりのカウント数
+
+/////////////////////////////////////////////////////////////////////////////
+// TextPart - テキスト パート
+// 折り返しや当たり判定で頻繁に読む幅と種類は TextDoc の配列に分けて持つ。
+
+struct TextPart {
+    enum Type {
+        NORMAL, // 通常テキスト
+        RUBY,   // ルビブロック
+        NEWLINE // 改行文字
+    };
+
+    // 元の compound_text 内での開始インデックス。テキストは TextDoc::m_text を参照する。
+    size_t m_start_index;
+    size_t m_end_index;
+
+    size_t m_base_index;
+    size_t m_base_len;
+
+    size_t m_ruby_index;
+    size_t m_ruby_len;
+
+    INT m_base_width;
+    INT m_ruby_width;
+
+    TextPart() {
+        m_base_width = 0;
+        m_ruby_width = 0;
+    }
+    bool has_ruby() const { return m_ruby_len > 0; }
+    INT update_width(TextDoc& doc, Type type);
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+// TextRun - テキストの連続
+
+struct TextRun {
+    INT m_part_index_start;
+    INT m_part_index_end;
+    INT m_base_height;
+    INT m_ruby_height;
+    INT m_run_width;
+    INT m_run_height;
+    INT m_max_width;
+    INT m_delta_x;
+    INT m_top; // 文書内での上端のY座標
+    bool m_has_ruby;
+
+    TextRun() {
+        m_part_index_start = 0;
+        m_part_index_end = 0;
+        m_base_height = 0;
+        m_ruby_height = 0;
+        m_run_width = 0;
+        m_run_height = 0;
+        m_max_width = 0;
+        m_delta_x = 0;
+        m_top = 0;
+        m_has_ruby = false;
+    }
+
+    void update_width(TextDoc& doc);
+    void update_height(TextDoc& doc);
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// TextPara - テキストの段落
+
+struct TextPara {
+    INT m_part_index_start;
+    INT m_part_index_end;
+    size_t m_start_index; // m_text 内での開始インデックス
+    size_t m_end_index;   // m_text 内での終了インデックス（改行文字を含まない）
+
+    TextPara() {
+        m_part_index_start = 0;
+        m_part_index_end = 0;
+        m_start_index = 0;
+        m_end_index = 0;
+    }
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// TextAdvanceCache - フォントごとの文字送り幅とグリフ番号のキャッシュ（コードポイントがキー）
+
+struct TextAdvanceCache {
+    enum {
+        UNKNOWN = -1, // 未計測
+        PENDING = -2  // 計測待ち（一括計測のため収集済み）
+    };
+    enum {
+        NO_GLYPH = 0xFFFF // グリフ番号がない（フォントにない文字、BMP外の文字）
+    };
+
+    // BMPの文字は256文字ごとのページで、それ以外はマップで保持する。
+    std::vector<std::vector<INT> > m_pages;
+    std::map<UINT, INT> m_astral;
+    // グリフ番号はBMPの文字だけ。フォントリンクが必要な文字は NO_GLYPH になる。
+    std::vector<std::vector<WORD> > m_glyph_pages;
+
+    void clear() {
+        m_pages.clear();
+        m_astral.clear();
+        m_glyph_pages.clear();
+    }
+    INT lookup(UINT code_point) const;
+    void store(UINT code_point, INT width);
+    WORD lookup_glyph(UINT code_point) const;
+    void store_glyph(UINT code_point, WORD glyph);
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// TextDocStats - 解析、計測、折り返しの回数と累積時間（FC_GETPERFSTATS 用）
+// 時間の単位は get_perf_ticks のカウント。
+
+struct TextDocStats {
+    uint32_t m_parse_calls;       // _parse_text の呼び出し回数
+    uint32_t m_parts_parsed;      // 解析で作ったパートの数
+    uint32_t m_measure_calls;     // _update_parts_width の呼び出し回数
+    uint32_t m_measurer_calls;    // TextMeasurer::measure_chars の呼び出し回数
+    uint32_t m_update_runs_calls; // update_runs の呼び出し回数
+    uint32_t m_runs_produced;     // update_runs で作ったランの数
+    uint64_t m_parse_ticks;       // 解析の累積時間
+    uint64_t m_measure_ticks;     // 計測の累積時間
+    uint64_t m_wrap_ticks;        // 折り返しの累積時間（計測を含まない）
+
+    TextDocStats() {
+        reset();
+    }
+    void reset() {
+        m_parse_calls = 0;
+        m_parts_parsed = 0;
+        m_measure_calls = 0;
+        m_measurer_calls = 0;
+        m_update_runs_calls = 0;
+        m_runs_produced = 0;
+        m_parse_ticks = 0;
+        m_measure_ticks = 0;
+        m_wrap_ticks = 0;
+    }
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// TextDoc - テキスト文書
+
+struct TextDoc {
+    // m_part_flags のビット
+    enum {
+        PF_TYPE_MASK = 0x03, // TextPart::Type
+        PF_HAS_RUBY = 0x04   // ルビテキストがある
+    };
+
+    std::wstring m_text;
+    std::vector<TextPart> m_parts;       // パートのインデックスなど（まれに読む）
+    std::vector<int32_t> m_part_widths;  // パートの幅。-1 なら計測が必要
+    std::vector<uint8_t> m_part_flags;   // パートの種類とフラグ (PF_*)
+    std::vector<int32_t> m_part_x;       // ランの左端からパートの左端までの幅（折り返しで求める）
+    std::vector<TextRun> m_runs;
+    std::vector<TextPara> m_paras;
+    FixedTextMeasurer m_fixed_measurer; // 既定の計測（GDIを使わない）
+    TextMeasurer *m_measurer;           // 計測に使うもの。弱い参照。
+    INT m_base_height;
+    INT m_ruby_height;
+    INT m_selection_start; // パートのインデックス。
+    INT m_selection_end; // パートのインデックス。
+    INT m_para_width; // 最も広いランの幅
+    INT m_max_width;
+    INT m_line_gap;
+    INT m_ruby_ratio_mul;
+    INT m_ruby_ratio_div;
+    INT m_gap_threshold;
+    TextAdvanceCache m_base_advances; // ベースフォントの文字送り幅
+    TextAdvanceCache m_ruby_advances; // ルビフォントの文字送り幅
+    UINT m_align_flags; // DT_CENTER, DT_RIGHT
+    INT m_unmeasured_part; // これより前のパートは計測済み
+    INT m_relayout_part; // 折り返しをやり直す最初のパート（段落の先頭）
+    INT m_relayout_end;  // 折り返しをやり直す範囲の終わり（段落の先頭）。-1 なら最後まで
+    bool m_set_focus;
+    DWORD m_layout_count; // 折り返しを行った回数（統計用）
+    TextDocStats m_stats; // 性能の統計 (FC_GETPERFSTATS)
+
+    // 入力の世代。入力が変わるたびに増やす。
+    UINT m_text_gen;
+    UINT m_font_gen;
+    UINT m_width_gen;
+    UINT m_gap_gen;
+    UINT m_align_gen;
+
+    // 各段階を計算したときの入力の世代（またはその和）
+    UINT m_measured_stamp; // m_text_gen + m_font_gen
+    UINT m_wrapped_stamp;  // m_text_gen + m_font_gen + m_width_gen
+    UINT m_runs_gap_gen;   // m_top を計算したときの m_gap_gen
+    UINT m_runs_align_gen; // m_delta_x を計算したときの m_align_gen
+
+    TextDoc() {
+        m_measurer = &m_fixed_measurer;
+        m_base_height = 0;
+        m_ruby_height = 0;
+        m_selection_start = -1;
+        m_selection_end = -1;
+        m_para_width = 0;
+        m_max_width = 0;
+        m_line_gap = 2;
+        m_gap_threshold = 0;
+        m_align_flags = 0;
+        m_unmeasured_part = 0;
+        m_relayout_part = 0;
+        m_relayout_end = -1;
+        m_set_focus = false;
+        m_layout_count = 0;
+        m_text_gen = m_font_gen = m_width_gen = 0;
+        m_gap_gen = m_align_gen = 0;
+        m_measured_stamp = m_wrapped_stamp = (UINT)-1; // 未計算
+        m_runs_gap_gen = m_runs_align_gen = 0;
+    }
+    void set_text(const std::wstring& text, UINT flags);
+    void append_text(const std::wstring& text, UINT flags);
+    void clear();
+    bool set_selection(INT iStart, INT iEnd, std::vector<RECT> *changed_rects = NULL);
+    std::wstring get_selection_text(INT type);
+    void set_dirty();
+    void set_measurer(TextMeasurer *measurer);
+    void set_line_gap(INT line_gap);
+    void get_normalized_selection(INT& iStart, INT& iEnd);
+
+    INT hit_test(INT x, INT y, UINT flags);
+
+    void get_ideal_size(LPRECT prc, UINT flags);
+    INT update_runs(UINT flags, INT iPartStart = 0, INT iPartEnd = -1);
+    bool get_part_position(INT iPart, INT layout_width, LPPOINT ppt, UINT flags);
+    bool get_parts_rect(INT iStart, INT iEnd, LPRECT prc) const;
+    bool get_parts_rects(INT iStart, INT iEnd, std::vector<RECT>& rects) const;
+    INT get_part_height(INT iPart);
+    INT find_run_of_part(INT iPart) const;
+    INT find_run_by_y(INT y) const;
+    void prepare_layout(INT layout_width, UINT flags);
+    UINT get_layout_stamp() const;
+    INT get_part_count() const { return (INT)m_part_widths.size(); }
+    TextPart::Type get_part_type(INT iPart) const {
+        return (TextPart::Type)(m_part_flags[iPart] & PF_TYPE_MASK);
+    }
+    std::wstring get_part_text(INT iPart) const;
+    wchar_t get_part_first_char(INT iPart) const;
+    wchar_t get_part_last_char(INT iPart) const;
+
+protected:
+    friend struct TextPart;
+
+    void _update_parts_height();
+    void _update_parts_width();
+    void _ensure_measured();
+    void ensure_layout(UINT flags);
+    void _set_max_width(INT max_width);
+    UINT _get_wrap_stamp() const;
+    bool _is_wrap_pending() const;
+    void _update_runs_top(INT iFirstRun);
+    INT _find_run_by_part(INT iPart) const;
+
+    void _reset_measurement();
+    void _collect_missing_chars(TextAdvanceCache& cache, size_t index, size_t len, std::wstring& missing);
+    void _measure_missing_chars(TextMeasurer::Font font, TextAdvanceCache& cache, const std::wstring& missing);
+    INT _get_text_width(TextMeasurer::Font font, TextAdvanceCache& cache, size_t index, size_t len);
+
+    void _add_part(
+        TextPart::Type type,
+        size_t start_index,
+        size_t end_index,
+        size_t base_index,
+        size_t base_len,
+        size_t ruby_index,
+        size_t ruby_len);
+    void _add_para(size_t ich, size_t ich_end);
+    void _parse_text(size_t ich, size_t ich_end);
+};
+
+/////////////////////////////////////////////////////////////////////////////
@@ -1,4 +1,5 @@
 ﻿// furigana_gdi.h
+// GDIでの計測と描画。解析とレイアウトは furigana_core.h。
 /////////////////////////////////////////////////////////////////////////////
 
 #pragma once
@@ -7,160 +8,143 @@
     #include <windows.h>
 #endif
 
-#include <string>
-#include <vector>
-#include "pstdint.h"
-
-struct TextDoc;
+#include "furigana_core.h"
 
 /////////////////////////////////////////////////////////////////////////////
-// TextPart - テキスト パート
-
-struct TextPart {
-    enum Type {
-        NORMAL, // 通常テキスト
-        RUBY,   // ルビブロック
-        NEWLINE // 改行文字
-    } m_type;
-
-    std::wstring m_text;
-
-    // 元の compound_text 内での開始インデックス
-    size_t m_start_index;
-    size_t m_end_index;
-
-    size_t m_base_index;
-    size_t m_base_len;
-
-    size_t m_ruby_index;
-    size_t m_ruby_len;
-
-    INT m_base_width;
-    INT m_ruby_width;
-    INT m_part_width;
-
-    TextPart() {
-        m_part_width = -1;
+// TextBatch - 一回の ExtTextOutW でまとめて描く文字の並び
+
+struct TextBatch {
+    std::wstring m_chars;      // 描く文字
+    std::vector<WORD> m_glyphs; // 描く文字のグリフ番号
+    bool m_all_glyphs;         // すべての文字にグリフ番号があるか？（ETO_GLYPH_INDEX で描けるか？）
+    std::vector<INT> m_pos;    // 各文字の左端のX座標
+    INT m_end_x;               // 最後の文字の右端のX座標
+    std::vector<INT> m_dx;     // ExtTextOutW に渡す文字送り幅（作業用）
+    COLORREF m_color;          // DCに設定済みの文字色
+
+    TextBatch() {
+        m_all_glyphs = true;
+        m_end_x = 0;
+        m_color = CLR_INVALID;
+    }
+    bool empty() const { return m_chars.empty(); }
+    void clear() {
+        m_chars.clear();
+        m_glyphs.clear();
+        m_all_glyphs = true;
+        m_pos.clear();
     }
-    bool has_ruby() const { return m_ruby_len > 0; }
-    void update_width(TextDoc& doc);
 };
 
-
 /////////////////////////////////////////////////////////////////////////////
-// TextRun - テキストの連続
-
-struct TextRun {
-    INT m_part_index_start;
-    INT m_part_index_end;
-    INT m_base_height;
-    INT m_ruby_height;
-    INT m_run_width;
-    INT m_run_height;
-    INT m_max_width;
-    INT m_delta_x;
-    bool m_has_ruby;
-
-    TextRun() {
-        m_part_index_start = 0;
-        m_part_index_end = 0;
-        m_base_height = 0;
-        m_ruby_height = 0;
-        m_run_width = 0;
-        m_run_height = 0;
-        m_max_width = 0;
-        m_delta_x = 0;
-        m_has_ruby = false;
+// GdiDrawStats - 描画の回数と累積時間（FC_GETPERFSTATS 用）
+
+struct GdiDrawStats {
+    uint32_t m_draw_calls;      // draw_doc で描画した回数
+    uint32_t m_parts_drawn;     // 描画したランに含まれるパートの数
+    uint32_t m_text_out_calls;  // ExtTextOutW の呼び出し回数
+    uint32_t m_fill_rect_calls; // FillRect の呼び出し回数
+    uint32_t m_gdi_calls;       // draw_doc で呼んだGDI関数の数（フォントと色の設定を含む）
+    uint64_t m_draw_ticks;      // draw_doc の累積時間 (get_perf_ticks)
+
+    GdiDrawStats() {
+        reset();
+    }
+    void reset() {
+        m_draw_calls = 0;
+        m_parts_drawn = 0;
+        m_text_out_calls = 0;
+        m_fill_rect_calls = 0;
+        m_gdi_calls = 0;
+        m_draw_ticks = 0;
     }
-
-    void update_width(TextDoc& doc);
-    void update_height(TextDoc& doc);
 };
 
 /////////////////////////////////////////////////////////////////////////////
-// TextPara - テキストの段落
+// GdiTextMeasurer - GDIで計測する（TextDoc の既定の計測）
 
-struct TextPara {
-    INT m_part_index_start;
-    INT m_part_index_end;
+struct GdiTextMeasurer : TextMeasurer {
+    HDC m_dc;          // 計測用のメモリDC
+    HFONT m_hFonts[2]; // ベースとルビのフォント。弱い参照。
 
-    TextPara() {
-        m_part_index_start = 0;
-        m_part_index_end = 0;
-    }
+    GdiTextMeasurer();
+    virtual ~GdiTextMeasurer();
+
+    void set_fonts(HFONT hBaseFont, HFONT hRubyFont);
+
+    virtual void measure_chars(Font font, LPCWSTR chars, INT cch, INT *extents, WORD *glyphs);
+    virtual INT get_font_height(Font font);
 };
 
 /////////////////////////////////////////////////////////////////////////////
-// TextDoc - テキスト文書
-
-struct TextDoc {
-    std::wstring m_text;
-    std::vector<TextPart> m_parts;
-    std::vector<TextRun> m_runs;
-    std::vector<TextPara> m_paras;
-    HDC m_dc;
-    INT m_base_height;
-    INT m_ruby_height;
-    INT m_selection_start; // パートのインデックス。
-    INT m_selection_end; // パートのインデックス。
-    INT m_para_width;
-    INT m_max_width;
-    INT m_line_gap;
-    INT m_ruby_ratio_mul;
-    INT m_ruby_ratio_div;
+// GdiTextDoc - GDIで計測して描画するテキスト文書
+
+struct GdiTextDoc : TextDoc {
+    GdiTextMeasurer m_gdi_measurer; // 既定の計測
     HFONT m_hBaseFont;
     HFONT m_hRubyFont;
-    INT m_gap_threshold;
-    bool m_layout_dirty;
-    bool m_set_focus;
-
-    TextDoc() {
-        m_dc = CreateCompatibleDC(NULL);
-        m_base_height = 0;
-        m_ruby_height = 0;
-        m_selection_start = -1;
-        m_selection_end = -1;
-        m_para_width = 0;
-        m_max_width = 0;
-        m_line_gap = 2;
+    COLORREF m_colors[4]; // テキスト、背景、選択テキスト、選択背景の色
+    HBRUSH m_hBackBrush; // m_colors[1] のブラシ
+    HBRUSH m_hSelBrush;  // m_colors[3] のブラシ
+    UINT m_color_gen;       // 色の世代
+    UINT m_brush_color_gen; // ブラシを作ったときの m_color_gen
+    GdiDrawStats m_draw_stats; // 描画の統計 (FC_GETPERFSTATS)
+    TextBatch m_batch; // _draw_run の作業用
+
+    GdiTextDoc() {
         m_hBaseFont = (HFONT)::GetStockObject(DEFAULT_GUI_FONT);
         m_hRubyFont = (HFONT)::GetStockObject(DEFAULT_GUI_FONT);
-        m_gap_threshold = 0;
-        m_layout_dirty = true;
-        m_set_focus = false;
+        m_gdi_measurer.set_fonts(m_hBaseFont, m_hRubyFont);
+        m_measurer = &m_gdi_measurer;
+        m_colors[0] = ::GetSysColor(COLOR_WINDOWTEXT);
+        m_colors[1] = ::GetSysColor(COLOR_WINDOW);
+        m_colors[2] = ::GetSysColor(COLOR_HIGHLIGHTTEXT);
+        m_colors[3] = ::GetSysColor(COLOR_HIGHLIGHT);
+        m_hBackBrush = m_hSelBrush = NULL;
+        m_color_gen = 0;
+        m_brush_color_gen = 0;
     }
-    ~TextDoc() {
-        DeleteDC(m_dc);
+    ~GdiTextDoc() {
+        _delete_brushes();
     }
 
-    void set_text(const std::wstring& text, UINT flags);
-    void clear();
-    void set_selection(INT iStart, INT iEnd);
-    std::wstring get_selection_text(INT type);
-    void set_dirty();
     void set_fonts(HFONT hBaseFont, HFONT hRubyFont);
-    void get_normalized_selection(INT& iStart, INT& iEnd);
-
-    INT hit_test(INT x, INT y, UINT flags);
+    void set_measurer(TextMeasurer *measurer);
+    void set_colors(const COLORREF *colors);
+    HBRUSH get_back_brush();
 
-    void draw_doc(HDC dc, LPRECT prc, UINT flags, const COLORREF *colors = NULL);
-    void get_ideal_size(LPRECT prc, UINT flags);
-    INT update_runs(UINT flags);
-    bool get_part_position(INT iPart, INT layout_width, LPPOINT ppt, UINT flags);
-    INT get_part_height(INT iPart);
+    void draw_doc(HDC dc, LPRECT prc, UINT flags, const COLORREF *colors = NULL, const RECT *prcVisible = NULL);
+    UINT get_render_stamp() const;
 
 protected:
-    void _update_parts_height();
-    void _update_parts_width();
-    void ensure_layout(UINT flags);
-
-    void _draw_run(
+    void _ensure_brushes();
+    void _delete_brushes();
+    void _draw_run_back(
+        HDC dc,
+        const TextRun& run,
+        INT left,
+        INT top,
+        HBRUSH hBackBrush,
+        HBRUSH hSelBrush,
+        INT iStart,
+        INT iEnd);
+    void _draw_run_base(
+        HDC dc,
+        const TextRun& run,
+        INT left,
+        INT top,
+        const COLORREF *colors,
+        INT iStart,
+        INT iEnd);
+    void _draw_run_ruby(
         HDC dc,
-        TextRun& run,
-        LPRECT prc,
-        UINT flags,
-        const COLORREF *colors = NULL);
-    void _add_para(const std::wstring& text);
+        const TextRun& run,
+        INT left,
+        INT top,
+        const COLORREF *colors,
+        INT iStart,
+        INT iEnd);
+    void _set_batch_color(HDC dc, COLORREF color, INT y);
+    void _add_to_batch(TextMeasurer::Font font, TextAdvanceCache& cache, size_t index, size_t len, INT x, INT extra);
+    void _flush_batch(HDC dc, INT y);
 };
-
-/////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,170 @@
+﻿// furigana_trace.cpp
+// FURIGANA_TRACE が有効なときだけビルドされる。
+/////////////////////////////////////////////////////////////////////////////
+
+#include "furigana_core.h"
+#include "furigana_trace.h"
+#include <cstdio>
+#include <cstdlib>
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
+    #define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+    #define TRACE_THREAD_LOCAL __thread
+#endif
+
+/////////////////////////////////////////////////////////////////////////////
+// TraceBuffer - スレッドごとのリングバッファ
+// 書き込むのは持ち主のスレッドだけなので、記録にロックは要らない。
+
+struct TraceEvent {
+    const char *m_name;
+    uint64_t m_start;
+    uint64_t m_end;
+};
+
+struct TraceBuffer {
+    enum {
+        CAPACITY = 65536 // 古いスパンから上書きする
+    };
+    TraceEvent m_events[CAPACITY];
+    volatile uint32_t m_count; // 記録したスパンの総数
+    uint32_t m_tid;
+    TraceBuffer *m_next;       // s_trace_buffers のリスト
+};
+
+// すべてのスレッドのバッファ。追加だけで、取り除かない（スレッドが終わってもダンプできるように）。
+static TraceBuffer * volatile s_trace_buffers = NULL;
+static TRACE_THREAD_LOCAL TraceBuffer *s_thread_buffer = NULL;
+
+static uint32_t get_trace_thread_id() {
+#ifdef _WIN32
+    return ::GetCurrentThreadId();
+#else
+    static volatile uint32_t s_next_tid = 0;
+    return __sync_add_and_fetch(&s_next_tid, 1);
+#endif
+}
+
+static uint32_t get_trace_process_id() {
+#ifdef _WIN32
+    return ::GetCurrentProcessId();
+#else
+    return (uint32_t)getpid();
+#endif
+}
+
+// このスレッドのバッファを作って、リストの先頭につなぐ
+static TraceBuffer *create_trace_buffer() {
+    TraceBuffer *buffer = new TraceBuffer;
+    buffer->m_count = 0;
+    buffer->m_tid = get_trace_thread_id();
+    for (;;) {
+        TraceBuffer *head = s_trace_buffers;
+        buffer->m_next = head;
+#ifdef _WIN32
+        if (InterlockedCompareExchangePointer((PVOID volatile *)&s_trace_buffers, buffer, head) == head)
+            break;
+#else
+        if (__sync_bool_compare_and_swap(&s_trace_buffers, head, buffer))
+            break;
+#endif
+    }
+    return buffer;
+}
+
+TraceSpan::TraceSpan(const char *name) {
+    // 名前がなければ記録しないので、時刻も取らない（名前のないメッセージのたびに呼ばれる）
+    m_name = name;
+    m_start = name ? get_perf_ticks() : 0;
+}
+
+TraceSpan::~TraceSpan() {
+    if (!m_name)
+        return;
+
+    TraceBuffer *buffer = s_thread_buffer;
+    if (!buffer)
+        s_thread_buffer = buffer = create_trace_buffer();
+
+    TraceEvent& event = buffer->m_events[buffer->m_count % TraceBuffer::CAPACITY];
+    event.m_name = m_name;
+    event.m_start = m_start;
+    event.m_end = get_perf_ticks();
+    ++buffer->m_count;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// JSON の文字列として書き出す
+static void write_json_string(FILE *fp, const char *str) {
+    std::fputc('"', fp);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\')
+            std::fputc('\\', fp);
+        if ((unsigned char)*str >= 0x20)
+            std::fputc(*str, fp);
+    }
+    std::fputc('"', fp);
+}
+
+/**
+ * 記録したスパンを Chrome のトレース形式でファイルに書き出す。
+ * スパンは完了イベント ("ph": "X") になり、スレッドごとに入れ子で表示される。
+ * @param filename 書き出すファイル名。
+ * @return 成功したら true。
+ */
+bool furigana_trace_dump(const char *filename) {
+    FILE *fp = std::fopen(filename, "w");
+    if (!fp)
+        return false;
+
+    // 時刻は最も古いスパンの開始を 0 とするマイクロ秒
+    uint64_t base = (uint64_t)-1;
+    for (TraceBuffer *buffer = s_trace_buffers; buffer; buffer = buffer->m_next) {
+        uint32_t count = buffer->m_count;
+        uint32_t first = (count > TraceBuffer::CAPACITY) ? count - TraceBuffer::CAPACITY : 0;
+        for (uint32_t i = first; i < count; ++i) {
+            const TraceEvent& event = buffer->m_events[i % TraceBuffer::CAPACITY];
+            if (event.m_start < base)
+                base = event.m_start;
+        }
+    }
+    const double usec_per_tick = 1e6 / (double)get_perf_frequency();
+    const uint32_t pid = get_trace_process_id();
+
+    std::fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first_event = true;
+    for (TraceBuffer *buffer = s_trace_buffers; buffer; buffer = buffer->m_next) {
+        uint32_t count = buffer->m_count;
+        uint32_t first = (count > TraceBuffer::CAPACITY) ? count - TraceBuffer::CAPACITY : 0;
+        for (uint32_t i = first; i < count; ++i) {
+            const TraceEvent& event = buffer->m_events[i % TraceBuffer::CAPACITY];
+            std::fprintf(fp, first_event ? "{\"name\": " : ",\n{\"name\": ");
+            write_json_string(fp, event.m_name);
+            std::fprintf(fp, ", \"cat\": \"furigana\", \"ph\": \"X\", \"pid\": %lu, \"tid\": %lu, \"ts\": %.3f, \"dur\": %.3f}",
+                         (unsigned long)pid, (unsigned long)buffer->m_tid,
+                         (double)(event.m_start - base) * usec_per_tick,
+                         (double)(event.m_end - event.m_start) * usec_per_tick);
+            first_event = false;
+        }
+    }
+    std::fprintf(fp, "\n]}\n");
+
+    bool ok = !std::ferror(fp);
+    std::fclose(fp);
+    return ok;
+}
+
+// 環境変数 FURIGANA_TRACE_FILE があれば、プロセスの終了時にそのファイルへ書き出す
+struct TraceAutoDump {
+    ~TraceAutoDump() {
+        const char *filename = std::getenv("FURIGANA_TRACE_FILE");
+        if (filename && *filename && s_trace_buffers)
+            furigana_trace_dump(filename);
+    }
+};
+static TraceAutoDump s_trace_auto_dump;
@@ -0,0 +1,39 @@
+﻿// furigana_trace.h
+// スコープ単位のトレース。CMake の FURIGANA_TRACE オプションでだけ有効になる。
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// FURIGANA_TRACE_SCOPE(name) は、そのスコープを抜けるまでの時間を1つのスパンとして記録する。
+// name は文字列リテラルなど、プログラムの終わりまで有効な文字列であること。NULL なら記録しない。
+// FURIGANA_TRACE が定義されていなければ何も生成せず、name も評価しない。
+
+#ifdef FURIGANA_TRACE
+
+#include "pstdint.h"
+
+/////////////////////////////////////////////////////////////////////////////
+// TraceSpan - 生存期間をスレッドごとのリングバッファに記録する
+
+struct TraceSpan {
+    const char *m_name;
+    uint64_t m_start; // get_perf_ticks
+
+    explicit TraceSpan(const char *name);
+    ~TraceSpan();
+};
+
+// 記録したスパンを Chrome のトレース形式 (JSON) でファイルに書き出す。
+// chrome://tracing や Perfetto で開ける。記録中の他のスレッドのスパンは欠けることがある。
+bool furigana_trace_dump(const char *filename);
+
+#define FURIGANA_TRACE_CONCAT0(a, b) a##b
+#define FURIGANA_TRACE_CONCAT(a, b) FURIGANA_TRACE_CONCAT0(a, b)
+#define FURIGANA_TRACE_SCOPE(name) \
+    TraceSpan FURIGANA_TRACE_CONCAT(trace_span_, __LINE__)(name)
+
+#else
+
+#define FURIGANA_TRACE_SCOPE(name) ((void)0)
+
+#endif // def FURIGANA_TRACE
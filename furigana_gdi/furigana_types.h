@@ -0,0 +1,54 @@
+﻿// furigana_types.h
+// Windows の型とマクロ。Windows 以外では furigana_core に必要なものだけを定義する。
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifdef _WIN32
+    #ifndef _INC_WINDOWS
+        #include <windows.h>
+    #endif
+#else
+    #include <stddef.h>
+    #include "pstdint.h"
+
+    typedef int INT;
+    typedef unsigned int UINT;
+    typedef int BOOL;
+    typedef int32_t LONG;
+    typedef uint16_t WORD;
+    typedef uint32_t DWORD;
+    typedef wchar_t WCHAR;
+    typedef const WCHAR *LPCWSTR;
+    typedef WCHAR *LPWSTR;
+
+    typedef struct tagPOINT {
+        LONG x;
+        LONG y;
+    } POINT, *LPPOINT;
+
+    typedef struct tagRECT {
+        LONG left;
+        LONG top;
+        LONG right;
+        LONG bottom;
+    } RECT, *LPRECT;
+
+    #ifndef TRUE
+        #define TRUE 1
+        #define FALSE 0
+    #endif
+
+    #define MAXLONG 0x7FFFFFFF
+
+    // DrawText のフラグ（揃えと単一行だけを使う）
+    #define DT_LEFT 0x00000000
+    #define DT_CENTER 0x00000001
+    #define DT_RIGHT 0x00000002
+    #define DT_SINGLELINE 0x00000020
+
+    // UTF-16 のサロゲート
+    #define IS_HIGH_SURROGATE(wch) (((wch) >= 0xD800) && ((wch) <= 0xDBFF))
+    #define IS_LOW_SURROGATE(wch) (((wch) >= 0xDC00) && ((wch) <= 0xDFFF))
+    #define IS_SURROGATE_PAIR(hs, ls) (IS_HIGH_SURROGATE(hs) && IS_LOW_SURROGATE(ls))
+#endif
@@ -0,0 +1,61 @@
+﻿// text_measurer.cpp
+/////////////////////////////////////////////////////////////////////////////
+
+#include "text_measurer.h"
+#include <vector>
+
+/**
+ * テキストの幅を計測する。
+ * @param font フォント。
+ * @param text テキスト。
+ * @param cch テキストの長さ（UTF-16の単位）。
+ * @return テキストの幅。
+ */
+INT TextMeasurer::get_text_width(Font font, LPCWSTR text, INT cch) {
+    if (cch <= 0)
+        return 0;
+    std::vector<INT> extents(cch);
+    std::vector<WORD> glyphs(cch, (WORD)NO_GLYPH);
+    measure_chars(font, text, cch, &extents[0], &glyphs[0]);
+    return extents[cch - 1];
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// FixedTextMeasurer
+
+/**
+ * コンストラクタ。
+ * @param base_size ベーステキストの全角文字の幅と高さ。
+ * @param ruby_size ルビテキストの全角文字の幅と高さ。
+ */
+FixedTextMeasurer::FixedTextMeasurer(INT base_size, INT ruby_size) {
+    m_wide_advance[BASE_FONT] = m_height[BASE_FONT] = base_size;
+    m_wide_advance[RUBY_FONT] = m_height[RUBY_FONT] = ruby_size;
+    m_narrow_advance[BASE_FONT] = base_size / 2;
+    m_narrow_advance[RUBY_FONT] = ruby_size / 2;
+}
+
+// 半角文字か？
+static inline bool is_narrow_char(WCHAR ch) {
+    return ch < 0x1100 || (0xFF61 <= ch && ch <= 0xFFDC);
+}
+
+void FixedTextMeasurer::measure_chars(Font font, LPCWSTR chars, INT cch, INT *extents, WORD * /*glyphs*/) {
+    INT extent = 0;
+    for (INT ich = 0; ich < cch; ++ich) {
+        WCHAR ch = chars[ich];
+        if (0xD800 <= ch && ch <= 0xDBFF && ich + 1 < cch) {
+            // サロゲートペアの幅は下位に持たせる（累積幅は文字の末尾で読む）
+            extents[ich] = extent;
+            extent += m_wide_advance[font];
+            extents[++ich] = extent;
+            continue;
+        }
+        extent += is_narrow_char(ch) ? m_narrow_advance[font] : m_wide_advance[font];
+        extents[ich] = extent;
+    }
+}
+
+INT FixedTextMeasurer::get_font_height(Font font) {
+    return m_height[font];
+}
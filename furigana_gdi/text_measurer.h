@@ -0,0 +1,56 @@
+﻿// text_measurer.h
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "furigana_types.h"
+
+/////////////////////////////////////////////////////////////////////////////
+// TextMeasurer - 文字の計測の抽象インターフェイス
+// TextDoc は計測をこのインターフェイスだけで行う。GDIでの実装は GdiTextMeasurer。
+
+struct TextMeasurer {
+    enum Font {
+        BASE_FONT, // ベーステキストのフォント
+        RUBY_FONT  // ルビテキストのフォント
+    };
+    enum {
+        NO_GLYPH = 0xFFFF // グリフ番号がない
+    };
+
+    virtual ~TextMeasurer() { }
+
+    /**
+     * 文字の並びを計測する。
+     * @param font フォント。
+     * @param chars 文字の並び（UTF-16）。
+     * @param cch 文字の数（UTF-16の単位）。
+     * @param extents 各文字の末尾までの累積幅を受け取る（GetTextExtentExPointW と同じ）。cch 個。
+     * @param glyphs グリフ番号を受け取る。cch 個。呼び出し側が NO_GLYPH で初期化しておく。
+     *               描画に使えるグリフ番号がなければ変更しない。
+     */
+    virtual void measure_chars(Font font, LPCWSTR chars, INT cch, INT *extents, WORD *glyphs) = 0;
+
+    /**
+     * フォントの高さを取得する（TEXTMETRIC の tmHeight 相当）。
+     * @param font フォント。
+     */
+    virtual INT get_font_height(Font font) = 0;
+
+    INT get_text_width(Font font, LPCWSTR text, INT cch);
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// FixedTextMeasurer - 固定の文字送り幅で計測する（GDIを使わない。テストやベンチマーク用）
+// 半角文字は狭い幅、それ以外は広い幅、サロゲートペアは広い幅1つとして数える。
+
+struct FixedTextMeasurer : TextMeasurer {
+    INT m_narrow_advance[2]; // 半角文字の送り幅（フォントごと）
+    INT m_wide_advance[2];   // 全角文字の送り幅（フォントごと）
+    INT m_height[2];         // フォントの高さ（フォントごと）
+
+    FixedTextMeasurer(INT base_size = 16, INT ruby_size = 8);
+
+    virtual void measure_chars(Font font, LPCWSTR chars, INT cch, INT *extents, WORD *glyphs);
+    virtual INT get_font_height(Font font);
+};